@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <stddef.h>
 
 /* audio processing unit */
 
@@ -14,74 +16,39 @@ struct APUEvent {
 };
 
 #define EVENT_QUEUE_SIZE 256
-struct APUEvent eventQueue[EVENT_QUEUE_SIZE];
-float eventQueueTimes[EVENT_QUEUE_SIZE];
-int eventQueueBase = 0;
-int eventQueuePtr = 0;
-int eventQueueAmount = 0;
-
-void insertAudioEvent(struct APUEvent e, float time){
-    if(EVENT_QUEUE_SIZE - eventQueueAmount == 0){
-        printf("audio event queue overflow :(\n");
-        return;
-    }
-
-    eventQueue[eventQueuePtr] = e;
-    eventQueueTimes[eventQueuePtr] = time;
-    eventQueuePtr++;
-    if(eventQueuePtr == EVENT_QUEUE_SIZE) eventQueuePtr = 0;
-    eventQueueAmount++;
-}
-
-void dequeueAudioEvent(){
-    if(eventQueueAmount == 0){
-        fprintf(stderr, "dequeueAudioEvent: empty queue, your logic leaves much to be desired\n");
-        exit(1);
-    }
-    eventQueueBase++;
-    eventQueueAmount--;
-}
-
-int peekAudioEvent(struct APUEvent *e, float *time){
-    if(eventQueueAmount == 0) return 0;
-    *e    = eventQueue[eventQueueBase];
-    *time = eventQueueTimes[eventQueueBase];
-    return 1;
-} 
 
+// at 44100Hz the CPU cycles 40.584 times per sample
+int sampleRate = 44100;
+double cyclesPerSample = 1789773.0 / 44100.0;
 
+// the channel timers count in 1/65536ths of a cpu cycle so that stepping
+// them one sample at a time or a whole run at once comes out the same
+#define TIMER_ONE 65536
+long long timerPerSample = 1789773LL * TIMER_ONE / 44100;
 
-struct TriangleWave {
-    int enable; // 4015
 
-    float phase;
-    float dt;
-    unsigned char timerHigh; // 400A
-    unsigned char timerLow;  // 400B
-
-    int length; // 400B
+// volume / envelope decay unit, shared by the square and noise channels
+struct Envelope {
+    unsigned char start;
+    unsigned char param; // constant volume or decay period
+    unsigned char counter;
+    unsigned char level;
+    unsigned char loop; // if 0, stop when length counter reaches zero
+    unsigned char constant; // if 0, decreasing envelope will be used for volume
 };
 
-
-
 struct SquareWave {
     int enable;
 
-    float phase;
-    float dt;
-    float volume;
+    unsigned int phase; // position in the 8 step sequence, top 3 bits = step
+    unsigned int inc; // phase increment per output sample
+    unsigned char volume; // 0 - 15
     int length; // decreases over time, silence note if it reaches zero
     unsigned char timerHigh;
     unsigned char timerLow;
     unsigned char duty;//0=12.5% 1=25% 2=50% 3=25% negated
-    unsigned char loop; // if 0, stop when length counter reaches zero
-    unsigned char constant; // if 0, decreasing envelope will be used for volume
 
-    // envelope bits and bobs, some of them
-    unsigned char envStart;
-    unsigned char envParam;
-    unsigned char envCounter;
-    unsigned char envLevel;
+    struct Envelope env;
 
     // sweep unit
     unsigned char sweepEnable;
@@ -95,9 +62,246 @@ struct SquareWave {
 
 };
 
-struct SquareWave sqr[2] =
-    {{0, 0.0, 220.0/44100.0, 0.0, 7, 255, 2, 0},
-     {0, 0.0, 220.0/44100.0, 0.0, 7, 255, 1, 0}};
+struct TriangleWave {
+    int enable; // 4015
+    int length; // 400B
+    unsigned char control; // 4008, halts length counter and linear reload
+    unsigned char linearParam; // 4008
+    unsigned char linearCounter;
+    unsigned char linearReload;
+    int period; // 400A, 400B
+    long long timer; // cpu cycles until the sequencer steps, fixed point
+    unsigned char step; // 0 - 31
+};
+
+struct NoiseWave {
+    int enable; // 4015
+    int length; // 400F
+    unsigned char volume; // 0 - 15
+    struct Envelope env; // 400C
+    unsigned char mode; // 400E, 1 = short sequence
+    int period; // 400E, in cpu cycles
+    long long timer; // fixed point, TIMER_ONE per cpu cycle
+    unsigned short shift; // 15 bit LFSR
+    int index; // position of shift in noise_sequence, mode 0 only
+};
+
+struct DeltaModulation {
+    int enable; // 4015, bytes remaining > 0
+    unsigned char loop; // 4010
+    int rate; // 4010, in cpu cycles per bit
+    long long timer; // fixed point, TIMER_ONE per cpu cycle
+    unsigned char output; // 4011, 7 bit DAC level
+    int sampleAddr; // 4012
+    int sampleLength; // 4013
+    int currentAddr;
+    int bytesRemaining;
+    unsigned char shift;
+    int bitsRemaining;
+    int silent; // output unit had no byte to play
+};
+
+/* apu state
+everything the apu changes as it runs is in one struct with no pointers
+in it, so the whole thing can be copied in and out of a machine snapshot.
+main.c owns the memory, see apuAttach.
+*/
+struct APU {
+    // actions 0x00 - 0x17 are writes to $4000 - $4017
+    struct APUEvent eventQueue[EVENT_QUEUE_SIZE];
+    long long eventQueueTimes[EVENT_QUEUE_SIZE];
+    int eventQueueBase;
+    int eventQueuePtr;
+    int eventQueueAmount;
+
+    // cpu cycles of emulation so far, this is the timestamp of new events.
+    // main.c advances it by whole instructions with apuClock.
+    long long apuCycle;
+
+    // the last byte written to each of $4000 - $4017, as the cpu wrote it
+    unsigned char regs[0x18];
+
+    // the cpu cycle which the next synthesized sample corresponds to
+    double synthTime;
+
+    struct SquareWave sqr[2];
+    struct TriangleWave tri;
+    struct NoiseWave noise;
+    struct DeltaModulation dmc;
+
+    // frame sequencer
+    int frameMode;
+    int frameStep;
+    long long frameBase;
+    long long frameNext; // cycle of the next step
+
+    // dc blocking filter
+    float dcLastIn;
+    float dcLastOut;
+};
+
+const struct APU apuPowerOn = {
+    .sqr = {
+        {.length = 7, .timerHigh = 255, .timerLow = 2},
+        {.length = 7, .timerHigh = 255, .timerLow = 1}
+    },
+    .noise = {.period = 4, .shift = 1},
+    .dmc = {
+        .rate = 428, .sampleAddr = 0xc000, .sampleLength = 1,
+        .currentAddr = 0xc000, .silent = 1
+    },
+    .frameNext = 7457
+};
+
+/* where everything is in struct APU, to fingerprint it and say what
+differs between two snapshots (main.c movieFrame, diffMachines).
+
+Only what the cpu did to the apu is fingerprinted: the cycle count, the
+registers and the writes in the event queue. Everything else follows
+synth, and how far synth has got is up to the host. The window runs it
+ahead of the cpu to keep the audio device fed, and further ahead in
+slow motion, while headless it stops where the cpu is. Those fields
+are marked synth and left out, so a replay matches its recording
+however the audio was being made either time. Nothing the cpu can see
+depends on them, a channel that plays differently in a replay got
+different writes, and those are in the fingerprint.
+*/
+struct APUField {
+    const char *name;
+    int offset;
+    int size;
+    int synth;
+};
+
+#define APU_FIELD(f) {#f, offsetof(struct APU, f), sizeof(((struct APU *)0)->f), 0}
+#define APU_SYNTH(f) {#f, offsetof(struct APU, f), sizeof(((struct APU *)0)->f), 1}
+
+const struct APUField apuFields[] = {
+    APU_FIELD(eventQueue), APU_FIELD(eventQueueTimes), APU_SYNTH(eventQueueBase),
+    APU_FIELD(eventQueuePtr), APU_SYNTH(eventQueueAmount), APU_FIELD(apuCycle),
+    APU_FIELD(regs), APU_SYNTH(synthTime), APU_SYNTH(sqr[0]), APU_SYNTH(sqr[1]),
+    APU_SYNTH(tri), APU_SYNTH(noise), APU_SYNTH(dmc), APU_SYNTH(frameMode),
+    APU_SYNTH(frameStep), APU_SYNTH(frameBase), APU_SYNTH(frameNext),
+    APU_SYNTH(dcLastIn), APU_SYNTH(dcLastOut)
+};
+
+#define APU_FIELDS (int)(sizeof apuFields / sizeof apuFields[0])
+
+extern unsigned long long xxh64(const void *data, size_t n, unsigned long long seed);
+
+// name of the field at offset in a struct APU, NULL for padding, synth
+// fields or past the end
+const char * apuFieldAt(int offset){
+    for(int i = 0; i < APU_FIELDS; i++){
+        const struct APUField *f = &apuFields[i];
+        if(offset >= f->offset && offset < f->offset + f->size) return f->synth ? NULL : f->name;
+    }
+    return NULL;
+}
+
+// the apu being run on this thread. Until main.c attaches a machine's
+// state it's this one.
+struct APU apuDefault;
+_Thread_local struct APU *apu = &apuDefault;
+
+// xxh64 of the apu on this thread, carrying on from seed
+unsigned long long apuHash(unsigned long long seed){
+    const unsigned char *p = (const unsigned char *)apu;
+    for(int i = 0; i < APU_FIELDS; i++){
+        if(apuFields[i].synth) continue;
+        seed = xxh64(p + apuFields[i].offset, apuFields[i].size, seed);
+    }
+    return seed;
+}
+
+
+void applyAudioEvent(struct APUEvent e, long long time);
+void dequeueAudioEvent();
+
+// the event queue is written a slot at a time, main.c keeps track of
+// which parts of it changed since a snapshot (see markDirty)
+extern void markDirty(const void *p, int n);
+
+// the part of the apu's state space that changes all the time, start to
+// end. Before it is the event queue, only changed through markDirty, and
+// after it is space that's never used.
+void apuHotBytes(int *start, int *end){
+    *start = offsetof(struct APU, eventQueueBase);
+    *end = sizeof(struct APU);
+}
+
+void insertAudioEvent(struct APUEvent e, long long time){
+    if(EVENT_QUEUE_SIZE - apu->eventQueueAmount == 0){
+        // synth is falling behind, do the oldest thing now rather than lose it
+        printf("audio event queue overflow :(\n");
+        applyAudioEvent(apu->eventQueue[apu->eventQueueBase], apu->eventQueueTimes[apu->eventQueueBase]);
+        dequeueAudioEvent();
+    }
+
+    apu->eventQueue[apu->eventQueuePtr] = e;
+    apu->eventQueueTimes[apu->eventQueuePtr] = time;
+    markDirty(&apu->eventQueue[apu->eventQueuePtr], sizeof(struct APUEvent));
+    markDirty(&apu->eventQueueTimes[apu->eventQueuePtr], sizeof(long long));
+    apu->eventQueuePtr++;
+    if(apu->eventQueuePtr == EVENT_QUEUE_SIZE) apu->eventQueuePtr = 0;
+    apu->eventQueueAmount++;
+}
+
+void dequeueAudioEvent(){
+    if(apu->eventQueueAmount == 0){
+        fprintf(stderr, "dequeueAudioEvent: empty queue, your logic leaves much to be desired\n");
+        exit(1);
+    }
+    apu->eventQueueBase++;
+    if(apu->eventQueueBase == EVENT_QUEUE_SIZE) apu->eventQueueBase = 0;
+    apu->eventQueueAmount--;
+}
+
+int peekAudioEvent(struct APUEvent *e, long long *time){
+    if(apu->eventQueueAmount == 0) return 0;
+    *e    = apu->eventQueue[apu->eventQueueBase];
+    *time = apu->eventQueueTimes[apu->eventQueueBase];
+    return 1;
+} 
+
+
+
+// frequency tables, in cpu cycles (NTSC)
+int noise_period_table[16] =
+    {
+        4, 8, 16, 32, 64, 96, 128, 160,
+        202, 254, 380, 508, 762, 1016, 2034, 4068
+    };
+
+int dmc_rate_table[16] =
+    {
+        428, 380, 340, 320, 286, 254, 226, 214,
+        190, 160, 142, 128, 106, 84, 72, 54
+    };
+
+unsigned char triangle_sequence[32] =
+    {
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+    };
+
+// the long noise sequence visits all 32767 nonzero LFSR states once, so
+// precompute it and step through it by index. noise_index is the inverse.
+#define NOISE_SEQUENCE_LENGTH 32767
+unsigned short noise_sequence[NOISE_SEQUENCE_LENGTH];
+unsigned short noise_index[32768];
+
+void initNoiseSequence(){
+    unsigned short shift = 1;
+    for(int i = 0; i < NOISE_SEQUENCE_LENGTH; i++){
+        noise_sequence[i] = shift;
+        noise_index[shift] = i;
+        int feedback = (shift ^ (shift >> 1)) & 1;
+        shift = (shift >> 1) | (feedback << 14);
+    }
+}
+
+extern unsigned char dmcFetch(int addr);
 
 
 void updateSweepTarget(struct SquareWave * g){
@@ -110,6 +314,24 @@ void updateSweepTarget(struct SquareWave * g){
     g->sweepMuting = timer < 8 || g->sweepTarget > 0x7ff;
 }
 
+// the sequencer steps every other cpu cycle, 8 steps per period
+void updatePulseIncrement(struct SquareWave * g){
+    int period = (g->timerHigh << 8) | g->timerLow;
+    double sequencesPerSample = cyclesPerSample / (16.0 * (period + 1));
+    // short periods (muted anyway) and low rates go past one sequence per
+    // sample. Whole sequences don't move the phase, so only the low 32
+    // bits are kept, converting straight to unsigned would be undefined.
+    g->inc = (unsigned long long)(sequencesPerSample * 4294967296.0);
+}
+
+void setSampleRate(int rate){
+    sampleRate = rate;
+    cyclesPerSample = 1789773.0 / rate;
+    timerPerSample = 1789773LL * TIMER_ONE / rate;
+    updatePulseIncrement(&apu->sqr[0]);
+    updatePulseIncrement(&apu->sqr[1]);
+}
+
 void clockSweepUnit(struct SquareWave * g){
 
     if(g->sweepEnable && g->sweepCounter == 0 && g->sweepShift > 0){
@@ -117,8 +339,7 @@ void clockSweepUnit(struct SquareWave * g){
             int period = g->sweepTarget;
             g->timerHigh = (period >> 8);
             g->timerLow  = period & 0xff;
-            float f = 1789773.0 / (16.0 * (period + 1));
-            g->dt = f / 44100.0;
+            updatePulseIncrement(g);
             updateSweepTarget(g);
         }
     }
@@ -133,123 +354,139 @@ void clockSweepUnit(struct SquareWave * g){
 
 }
 
-void clockEnvelope(struct SquareWave * g){
-    if(g->envStart){
-        g->envStart = 0;
-        g->envLevel = 15;
-        g->envCounter = g->envParam;
+// returns the new volume 0 - 15
+int clockEnvelope(struct Envelope * e){
+    if(e->start){
+        e->start = 0;
+        e->level = 15;
+        e->counter = e->param;
     }
     else{
-        g->envCounter--;
-        if(g->envCounter == 0){
-            g->envCounter = g->envParam;
-            if(g->envLevel == 0){
-                if(g->loop) g->envLevel = 15;
+        e->counter--;
+        if(e->counter == 0){
+            e->counter = e->param;
+            if(e->level == 0){
+                if(e->loop) e->level = 15;
                 // else nothing happens and level remains zero
             }
             else{
-                g->envLevel--;
+                e->level--;
             }
         }
     }
 
-    if(g->constant){
-        g->volume = ((float)g->envParam) / 15.0;
+    return e->constant ? e->param : e->level;
+}
+
+void clockLinearCounter(struct TriangleWave * g){
+    if(g->linearReload){
+        g->linearCounter = g->linearParam;
     }
-    else{
-        g->volume = ((float)g->envLevel) / 15.0;
+    else if(g->linearCounter > 0){
+        g->linearCounter--;
     }
 
+    if(g->control == 0) g->linearReload = 0;
 }
 
 
-float polyblep(float dt, float t){
-    if(t < dt){
-        t /= dt;
-        return t+t - t*t - 1.0;
-    }
-    else if(1.0 - dt < t){
-        t = (t - 1.0) / dt;
-        return t*t + t+t + 1.0;
-    }
-    else
-        return 0.0;
+// The timers are stepped once per output sample, or once per run when
+// nothing is listening. The number of timer expirations in that time is
+// worked out with one division instead of counting cycles.
+int stepTimer(long long *timer, int period, int numSamples){
+    *timer -= numSamples * timerPerSample;
+    if(*timer > 0) return 0;
+    long long p = (long long)period * TIMER_ONE;
+    int n = -*timer / p + 1;
+    *timer += n * p;
+    return n;
 }
 
-float squareWave(float dt, float t){
-    float value = t < 0.5 ? 1.0 : -1.0;
-    value += polyblep(dt, t);
-    value -= polyblep(dt, fmod(t + 0.5, 1.0));
-    return value;
-}
+/* square wave kernel
+While a run of samples has no events in it nothing about a square
+channel changes except its phase, so the whole run is done at once,
+four samples at a time with no branches. The duty cycles
 
-float sqrGenerator(struct SquareWave *g){
-    float out = 0.0;
-    if(g->enable == 0) return 0.0;
-    if(g->volume == 0) return 0.0;
-    if(g->length == 0) return 0.0;
-    if(g->sweepMuting) return 0.0;
+  0: 0 1 0 0 0 0 0 0
+  1: 0 1 1 0 0 0 0 0
+  2: 0 1 1 1 1 0 0 0
+  3: 1 0 0 1 1 1 1 1
 
-    if(g->duty == 2){ // 50% duty cycle
-        out += 0.1 * g->volume * squareWave(g->dt, g->phase);
-        g->phase += g->dt;
-        if(g->phase > 1.0) g->phase -= 1.0;
+are all "1 <= step <= width", inverted for duty 3, which is two
+compares and an xor per lane.
+*/
+
+typedef int v4i __attribute__((vector_size(16)));
+typedef unsigned int v4u __attribute__((vector_size(16)));
+
+int duty_width[4] = {1, 2, 4, 2};
+int duty_invert[4] = {0, 0, 0, -1};
+
+// add the channel's level for numSamples samples into out
+void sqrKernel(struct SquareWave *g, int *out, int numSamples){
+    unsigned int inc = g->inc;
+    int gate = (g->enable && g->length && !g->sweepMuting) ? g->volume : 0;
+    int width = duty_width[g->duty];
+    int invert = duty_invert[g->duty];
+
+    v4u phase = {g->phase + inc, g->phase + 2*inc, g->phase + 3*inc, g->phase + 4*inc};
+    v4u step = {4*inc, 4*inc, 4*inc, 4*inc};
+
+    int i = 0;
+    for(; i + 4 <= numSamples; i += 4){
+        v4i s = (v4i)(phase >> 29) - 1;
+        v4i on = ((s >= 0) & (s < width)) ^ invert;
+        v4i acc;
+        memcpy(&acc, out + i, sizeof(acc));
+        acc += on & gate;
+        memcpy(out + i, &acc, sizeof(acc));
+        phase += step;
     }
-    else{
-        float shift = g->duty == 0 ? 0.0625 : 0.125; // 12.5% or 25%
-        out += squareWave(g->dt/2, g->phase);
-        out -= squareWave(g->dt/2, fmod(g->phase + shift, 1));
-        out /= 2.0;
-        out = fabs(out);
-        out -= 0.5;
-        out *= 0.1 * g->volume;
-        g->phase += g->dt/2;
-        if(g->phase > 1.0) g->phase -= 1.0;
+
+    unsigned int p = g->phase + (i + 1) * inc;
+    for(; i < numSamples; i++){
+        int s = (int)(p >> 29) - 1;
+        int on = -(s >= 0 && s < width) ^ invert;
+        out[i] += on & gate;
+        p += inc;
     }
-    return out;
+
+    g->phase += numSamples * inc;
 }
 
 void setEnable(int ch, unsigned char en){
-    sqr[ch].enable = en;
+    apu->sqr[ch].enable = en;
     if(en == 0){
-        sqr[ch].length = 0;
+        apu->sqr[ch].length = 0;
     }
 }
 
 void setTimerLow(int ch, unsigned char byte){
-    sqr[ch].timerLow = byte;
-    int period = (sqr[ch].timerHigh << 8) | sqr[ch].timerLow;
-    float f = 1789773.0 / (16.0 * (period + 1));
-    sqr[ch].dt = f / 44100.0;
-    updateSweepTarget(&sqr[ch]);
+    apu->sqr[ch].timerLow = byte;
+    updatePulseIncrement(&apu->sqr[ch]);
+    updateSweepTarget(&apu->sqr[ch]);
 }
 
 void setTimerHigh(int ch, unsigned char byte){
-    sqr[ch].timerHigh = byte;
-    int period = (sqr[ch].timerHigh << 8) | sqr[ch].timerLow;
-    float f = 1789773.0 / (16.0 * (period + 1));
-    sqr[ch].dt = f / 44100.0;
-    updateSweepTarget(&sqr[ch]);
+    apu->sqr[ch].timerHigh = byte;
+    apu->sqr[ch].phase = 0; // the sequencer restarts
+    updatePulseIncrement(&apu->sqr[ch]);
+    updateSweepTarget(&apu->sqr[ch]);
 }
 
 void setEnvelope(int ch, unsigned char byte){
     unsigned char lownib = byte & 0x0f;
 
-    sqr[ch].envParam = lownib;
-    sqr[ch].loop = (byte >> 5) & 1;
-    sqr[ch].constant = (byte >> 4) & 1;
+    apu->sqr[ch].env.param = lownib;
+    apu->sqr[ch].env.loop = (byte >> 5) & 1;
+    apu->sqr[ch].env.constant = (byte >> 4) & 1;
 
-    if(sqr[ch].constant){
-        sqr[ch].volume = ((float)lownib) / 15.0;
-    }
-    else{
-        sqr[ch].volume = ((float)lownib) / 15.0;
-    }
+    apu->sqr[ch].volume = lownib;
 
 }
 
 void setDutyCycle(int ch, unsigned char d){
-    sqr[ch].duty = d;
+    apu->sqr[ch].duty = d;
 }
 
 unsigned char length_table[32] =
@@ -261,78 +498,144 @@ unsigned char length_table[32] =
     };
 
 void setLengthCounter(int ch, unsigned char n){
-    if(sqr[ch].enable == 0) return;
-    if(sqr[ch].enable){
-        sqr[ch].length = length_table[n];
-        sqr[ch].envStart = 1;
+    if(apu->sqr[ch].enable == 0) return;
+    if(apu->sqr[ch].enable){
+        apu->sqr[ch].length = length_table[n];
+        apu->sqr[ch].env.start = 1;
     }
 }
 
 void setSweep(int ch, unsigned char byte){
-    sqr[ch].sweepEnable = byte >> 7;
-    sqr[ch].sweepPeriod = (byte >> 4) & 7;
-    sqr[ch].sweepNegate = (byte >> 3) & 1;
-    sqr[ch].sweepShift  = byte & 7;
-    sqr[ch].sweepReload = 1;
-    updateSweepTarget(&sqr[ch]);
+    apu->sqr[ch].sweepEnable = byte >> 7;
+    apu->sqr[ch].sweepPeriod = (byte >> 4) & 7;
+    apu->sqr[ch].sweepNegate = (byte >> 3) & 1;
+    apu->sqr[ch].sweepShift  = byte & 7;
+    apu->sqr[ch].sweepReload = 1;
+    updateSweepTarget(&apu->sqr[ch]);
 }
 
-// this frame counter has nothing to do with video frames
-int frameCounter = 0;
-int frameCounterPeriod = 2*14915;
-int frameCounterMode = 0;
-void apuFrameHalfClock(){
-    frameCounter++;
+void setTriangleLinear(unsigned char byte){
+    apu->tri.control = byte >> 7;
+    apu->tri.linearParam = byte & 0x7f;
+}
 
-    int wholeFrame = frameCounter / 2;
-    int halfFrame = frameCounter % 2;
+void setTriangleTimerLow(unsigned char byte){
+    apu->tri.period = (apu->tri.period & 0x700) | byte;
+}
 
-    if(wholeFrame == 3728 && halfFrame){
-        // envelope, linear counter clock
-        clockEnvelope(&sqr[0]);
-        clockEnvelope(&sqr[1]);
-    }
+void setTriangleTimerHigh(unsigned char byte){
+    apu->tri.period = (apu->tri.period & 0xff) | ((byte & 7) << 8);
+    if(apu->tri.enable) apu->tri.length = length_table[byte >> 3];
+    apu->tri.linearReload = 1;
+}
 
-    if(wholeFrame == 7456 && halfFrame){
-        // envelope, linear counter clock
-        // length counter, sweep units
+void setNoiseEnvelope(unsigned char byte){
+    apu->noise.env.param = byte & 0x0f;
+    apu->noise.env.loop = (byte >> 5) & 1;
+    apu->noise.env.constant = (byte >> 4) & 1;
+    apu->noise.volume = apu->noise.env.param;
+}
 
-        if(sqr[0].length > 0 && sqr[0].loop == 0){ sqr[0].length--; }
-        if(sqr[1].length > 0 && sqr[1].loop == 0){ sqr[1].length--; }
-        clockEnvelope(&sqr[0]);
-        clockEnvelope(&sqr[1]);
-        clockSweepUnit(&sqr[0]);
-        clockSweepUnit(&sqr[1]);
+void setNoisePeriod(unsigned char byte){
+    unsigned char mode = byte >> 7;
+    if(mode == 0 && apu->noise.mode == 1){
+        // back on the long sequence, find out where we are in it
+        apu->noise.index = noise_index[apu->noise.shift];
     }
+    apu->noise.mode = mode;
+    apu->noise.period = noise_period_table[byte & 0x0f];
+}
 
-    if(wholeFrame == 11185 && halfFrame){
-        // envelope, linear counter clock
-        clockEnvelope(&sqr[0]);
-        clockEnvelope(&sqr[1]);
+void setNoiseLength(unsigned char byte){
+    if(apu->noise.enable){
+        apu->noise.length = length_table[byte >> 3];
+        apu->noise.env.start = 1;
     }
+}
 
-    if(
-        (frameCounterMode == 0 && wholeFrame == 14914 && halfFrame) ||
-        (frameCounterMode == 1 && wholeFrame == 18640 && halfFrame)
-    )
-    {
-        // envelope, linear counter clock
-        // length counter, sweep units
-        if(sqr[0].length > 0 && sqr[0].loop == 0){ sqr[0].length--; }
-        if(sqr[1].length > 0 && sqr[1].loop == 0){ sqr[1].length--; }
-        clockEnvelope(&sqr[0]);
-        clockEnvelope(&sqr[1]);
-        clockSweepUnit(&sqr[0]);
-        clockSweepUnit(&sqr[1]);
+void restartDMC(){
+    apu->dmc.currentAddr = apu->dmc.sampleAddr;
+    apu->dmc.bytesRemaining = apu->dmc.sampleLength;
+}
+
+void setDMCFlags(unsigned char byte){
+    // IRQ is not supported
+    apu->dmc.loop = (byte >> 6) & 1;
+    apu->dmc.rate = dmc_rate_table[byte & 0x0f];
+}
+
+void setDMCEnable(unsigned char en){
+    if(en == 0){
+        apu->dmc.bytesRemaining = 0;
+    }
+    else if(apu->dmc.bytesRemaining == 0){
+        restartDMC();
     }
+    apu->dmc.enable = apu->dmc.bytesRemaining > 0;
+}
+
+// this frame counter has nothing to do with video frames
+// it lives in synth time like everything else here. Instead of counting
+// cycles it knows the cycle of its next step and synth stops there.
+#define FRAME_QUARTER 1 // envelopes, linear counter
+#define FRAME_HALF    2 // and length counters, sweep units
 
-    if(frameCounter == frameCounterPeriod) frameCounter = 0;
+// cycles are counted from the start of the sequence ($4017 write or wrap)
+int frame_step_cycles[2][5] =
+    {
+        {7457, 14913, 22371, 29829, 0},
+        {7457, 14913, 22371, 29829, 37281}
+    };
+
+unsigned char frame_step_action[2][5] =
+    {
+        {FRAME_QUARTER, FRAME_HALF, FRAME_QUARTER, FRAME_HALF, 0},
+        {FRAME_QUARTER, FRAME_HALF, FRAME_QUARTER, 0, FRAME_HALF}
+    };
+
+int frame_sequence_steps[2] = {4, 5};
+int frame_sequence_period[2] = {29830, 37282};
+
+void quarterFrame(){
+    apu->sqr[0].volume = clockEnvelope(&apu->sqr[0].env);
+    apu->sqr[1].volume = clockEnvelope(&apu->sqr[1].env);
+    apu->noise.volume  = clockEnvelope(&apu->noise.env);
+    clockLinearCounter(&apu->tri);
+}
+
+void halfFrame(){
+    quarterFrame();
+    if(apu->sqr[0].length > 0 && apu->sqr[0].env.loop == 0){ apu->sqr[0].length--; }
+    if(apu->sqr[1].length > 0 && apu->sqr[1].env.loop == 0){ apu->sqr[1].length--; }
+    if(apu->tri.length > 0 && apu->tri.control == 0){ apu->tri.length--; }
+    if(apu->noise.length > 0 && apu->noise.env.loop == 0){ apu->noise.length--; }
+    clockSweepUnit(&apu->sqr[0]);
+    clockSweepUnit(&apu->sqr[1]);
+}
+
+// do the step due at frameNext and schedule the one after
+void clockFrameSequencer(){
+    int action = frame_step_action[apu->frameMode][apu->frameStep];
+    if(action == FRAME_QUARTER) quarterFrame();
+    if(action == FRAME_HALF) halfFrame();
+
+    apu->frameStep++;
+    if(apu->frameStep == frame_sequence_steps[apu->frameMode]){
+        apu->frameStep = 0;
+        apu->frameBase += frame_sequence_period[apu->frameMode];
+    }
+    apu->frameNext = apu->frameBase + frame_step_cycles[apu->frameMode][apu->frameStep];
 }
 
-void setFrameCounterPeriod(unsigned char bit){
-    if(bit == 0) frameCounterPeriod = 14915;
-    if(bit == 1) frameCounterPeriod = 18641;
-    frameCounter = 0;
+// $4017, restarts the sequence at the cycle of the write
+void setFrameCounterMode(unsigned char bit, long long time){
+    apu->frameMode = bit;
+    apu->frameStep = 0;
+    apu->frameBase = time;
+    apu->frameNext = apu->frameBase + frame_step_cycles[apu->frameMode][0];
+
+    // 5 step mode clocks everything right away
+    if(apu->frameMode == 1) halfFrame();
 }
 
 
@@ -409,24 +712,132 @@ apuClk -
 */
 
 
-struct TriangleGenerator {
-    unsigned char counter; // 5 bits
-    unsigned char output; // 4 bits
-    // input1: length counter OR linear counter == 0
-    // input2: programmable timer terminal count
-};
+// the sequencer only moves while both counters are nonzero, otherwise
+// the output holds wherever it stopped
+int triGenerator(struct TriangleWave *g){
+    if(g->length && g->linearCounter){
+        int n = stepTimer(&g->timer, g->period + 1, 1);
+        g->step = (g->step + n) & 31;
+    }
+
+    // ultrasonic periods average out to the middle on real hardware
+    if(g->period < 2) return 7;
+
+    return triangle_sequence[g->step];
+}
+
+int noiseGenerator(struct NoiseWave *g){
+    int n = stepTimer(&g->timer, g->period, 1);
+
+    if(g->mode == 0){
+        g->index = (g->index + n) % NOISE_SEQUENCE_LENGTH;
+        g->shift = noise_sequence[g->index];
+    }
+    else{
+        // the short sequence depends on where it starts, step it by hand
+        for(int i = 0; i < n; i++){
+            int feedback = (g->shift ^ (g->shift >> 6)) & 1;
+            g->shift = (g->shift >> 1) | (feedback << 14);
+        }
+    }
+
+    if(g->enable == 0) return 0;
+    if(g->length == 0) return 0;
+
+    return g->shift & 1 ? 0 : g->volume;
+}
+
+int dmcGenerator(struct DeltaModulation *g){
+    // the fastest rate is 54 cycles, so above about 33.1kHz there's at
+    // most one bit per sample, below that there can be several
+    int n = stepTimer(&g->timer, g->rate, 1);
+
+    for(int i = 0; i < n; i++){
+        if(g->bitsRemaining == 0){
+            g->bitsRemaining = 8;
+            if(g->bytesRemaining == 0){
+                g->silent = 1;
+            }
+            else{
+                g->silent = 0;
+                g->shift = dmcFetch(g->currentAddr);
+                g->currentAddr = g->currentAddr == 0xffff ? 0x8000 : g->currentAddr + 1;
+                g->bytesRemaining--;
+                if(g->bytesRemaining == 0 && g->loop) restartDMC();
+                g->enable = g->bytesRemaining > 0;
+            }
+        }
+
+        if(!g->silent){
+            if(g->shift & 1){
+                if(g->output <= 125) g->output += 2;
+            }
+            else{
+                if(g->output >= 2) g->output -= 2;
+            }
+        }
+        g->shift >>= 1;
+        g->bitsRemaining--;
+    }
+
+    return g->output;
+}
 
-struct TriangleGenerator tri = {0,0};
 
-// happens when programmer timer reaches 0
-// unless length counter OR linear counter are zero
-void clockTriangleGenerator(struct TriangleGenerator *g){
-    g->counter = (g->counter + 1) & 0x1f;
-    g->output = ((g->counter >> 4) ? 0xf : 0x0) ^ (g->counter & 0xf);
+
+/* mixer
+the channels are mixed by a resistor network which isn't linear. The
+standard approximation is
+  pulse_out = 95.88 / (8128 / (pulse1 + pulse2) + 100)
+  tnd_out = 159.79 / (1 / (triangle / 8227 + noise / 12241 + dmc / 22638) + 100)
+which is close enough to two tables indexed by integer sums of levels.
+*/
+float pulse_table[31];
+float tnd_table[203];
+
+void initMixerTables(){
+    pulse_table[0] = 0.0;
+    for(int n = 1; n < 31; n++){
+        pulse_table[n] = 95.52 / (8128.0 / n + 100.0);
+    }
+    tnd_table[0] = 0.0;
+    for(int n = 1; n < 203; n++){
+        tnd_table[n] = 163.67 / (24329.0 / n + 100.0);
+    }
 }
 
+// the mixer output is all positive and moves around with the levels
+// the channels are left at, so it goes through a one pole high pass
+// (about 37Hz) to take the DC offset out
+#define DC_POLE 0.995
 
+// put the attached apu in its power on state
+void resetAPU(){
+    *apu = apuPowerOn;
+}
+
+// the tables are shared by every apu, they're built by the first call.
+// Make that one before starting other threads.
+int apuTablesReady = 0;
 
+void initAPU(){
+    if(!apuTablesReady){
+        initNoiseSequence();
+        initMixerTables();
+        apuTablesReady = 1;
+    }
+    resetAPU();
+}
+
+// run the apu in state, which is size bytes of memory owned by the caller.
+// This is how main.c keeps the apu inside its machine struct.
+void apuAttach(void *state, int size){
+    if(size < (int)sizeof(struct APU)){
+        fprintf(stderr, "apuAttach: %d bytes is too small, the apu needs %d\n", size, (int)sizeof(struct APU));
+        exit(1);
+    }
+    apu = state;
+}
 
 void dumpState(FILE *file){
     // frame counter
@@ -436,25 +847,202 @@ void dumpState(FILE *file){
     // square wave generator 1 and 2
 }
 
-// generate numSamples more samples worth of output
-// each sample is 1/44100 seconds of time
-// events might occur between samples
-// in 1/44100 seconds, the CPU cycles 40.4595 times
-void synth(float *out, int numSamples){
+void applyAudioEvent(struct APUEvent e, long long time){
+    unsigned char byte = e.data;
+    switch(e.action){
+        case 0x00:
+            setEnvelope(0, byte & 0x3f);
+            setDutyCycle(0, byte >> 6);
+            break;
+        case 0x01: setSweep(0, byte); break;
+        case 0x02: setTimerLow(0, byte); break;
+        case 0x03:
+            setTimerHigh(0, byte & 7);
+            setLengthCounter(0, byte >> 3);
+            break;
+        case 0x04:
+            setEnvelope(1, byte & 0x3f);
+            setDutyCycle(1, byte >> 6);
+            break;
+        case 0x05: setSweep(1, byte); break;
+        case 0x06: setTimerLow(1, byte); break;
+        case 0x07:
+            setTimerHigh(1, byte & 7);
+            setLengthCounter(1, byte >> 3);
+            break;
+        case 0x08: setTriangleLinear(byte); break;
+        case 0x0a: setTriangleTimerLow(byte); break;
+        case 0x0b: setTriangleTimerHigh(byte); break;
+        case 0x0c: setNoiseEnvelope(byte); break;
+        case 0x0e: setNoisePeriod(byte); break;
+        case 0x0f: setNoiseLength(byte); break;
+        case 0x10: setDMCFlags(byte); break;
+        case 0x11: apu->dmc.output = byte & 0x7f; break;
+        case 0x12: apu->dmc.sampleAddr = 0xc000 + byte * 64; break;
+        case 0x13: apu->dmc.sampleLength = byte * 16 + 1; break;
+        case 0x15:
+            setEnable(0, byte & 1);
+            setEnable(1, (byte >> 1) & 1);
+            apu->tri.enable = (byte >> 2) & 1;
+            if(apu->tri.enable == 0) apu->tri.length = 0;
+            apu->noise.enable = (byte >> 3) & 1;
+            if(apu->noise.enable == 0) apu->noise.length = 0;
+            setDMCEnable((byte >> 4) & 1);
+            break;
+        case 0x17: setFrameCounterMode(byte >> 7, time); break;
+        default:
+            break;
+    }
+}
+
+// cpu writes to $4000 - $4017 land here. They are stamped with the
+// current cycle and take effect when synth reaches that sample.
+void apuWrite(int addr, unsigned char byte){
+    struct APUEvent e = {addr - 0x4000, byte};
+    apu->regs[addr - 0x4000] = byte;
+    insertAudioEvent(e, apu->apuCycle);
+}
+
+// main.c calls this after every instruction with its length
+void apuClock(int cycles){
+    apu->apuCycle += cycles;
+}
+
+// how many samples it takes for synth to catch up to the cpu
+int apuSamplesPending(){
+    double behind = apu->apuCycle - apu->synthTime;
+    if(behind <= 0.0) return 0;
+    return behind / cyclesPerSample;
+}
+
+void advanceRun(int numSamples);
+
+// generate samples with no events happening in between
+#define SYNTH_CHUNK 256
+void synthRun(float *out, int numSamples){
+    float in = apu->dcLastIn;
+    float y = apu->dcLastOut;
 
-    if(!sqr[0].volume && !sqr[1].volume){
+    // nothing is heard moving, the mixer input is just the level the
+    // triangle and dmc were left at. The channels still run underneath.
+    if(
+        !apu->sqr[0].volume && !apu->sqr[1].volume &&
+        (!apu->noise.volume || !apu->noise.length) &&
+        (!apu->tri.length || !apu->tri.linearCounter) &&
+        !apu->dmc.enable && (apu->dmc.silent || apu->dmc.bitsRemaining == 0)
+    ){
+        int t = apu->tri.period < 2 ? 7 : triangle_sequence[apu->tri.step];
+        float x = tnd_table[3*t + apu->dmc.output];
         for(int i = 0; i < numSamples; i++){
-            out[i] = 0.0;
+            y = x - in + DC_POLE * y;
+            in = x;
+            out[i] = y;
         }
+        apu->dcLastIn = in;
+        apu->dcLastOut = y;
+        advanceRun(numSamples);
         return;
     }
 
-    for(int i = 0; i < numSamples; i++){
-        out[i] = 0.0;
+    int pulse[SYNTH_CHUNK];
+
+    for(int base = 0; base < numSamples; base += SYNTH_CHUNK){
+        int n = numSamples - base;
+        if(n > SYNTH_CHUNK) n = SYNTH_CHUNK;
+
+        memset(pulse, 0, n * sizeof(int));
+        sqrKernel(&apu->sqr[0], pulse, n);
+        sqrKernel(&apu->sqr[1], pulse, n);
+
+        for(int i = 0; i < n; i++){
+            int t = 3*triGenerator(&apu->tri) + 2*noiseGenerator(&apu->noise) + dmcGenerator(&apu->dmc);
+            float x = pulse_table[pulse[i]] + tnd_table[t];
+            y = x - in + DC_POLE * y;
+            in = x;
+            out[base + i] = y;
+        }
+    }
+
+    apu->dcLastIn = in;
+    apu->dcLastOut = y;
+}
 
-        out[i] += sqrGenerator(&sqr[0]);
-        out[i] += sqrGenerator(&sqr[1]);
+// advance the channels through a run the same as synthRun would, without
+// mixing anything. The square phases and the fixed point timers are
+// integer sums, so they jump straight to the end of the run and land in
+// exactly the state sample by sample stepping would have left them in.
+void advanceRun(int numSamples){
+    apu->sqr[0].phase += numSamples * apu->sqr[0].inc;
+    apu->sqr[1].phase += numSamples * apu->sqr[1].inc;
+
+    if(apu->tri.length && apu->tri.linearCounter){
+        int n = stepTimer(&apu->tri.timer, apu->tri.period + 1, numSamples);
+        apu->tri.step = (apu->tri.step + n) & 31;
     }
 
+    if(apu->noise.mode == 0 && numSamples > 0){
+        int n = stepTimer(&apu->noise.timer, apu->noise.period, numSamples);
+        apu->noise.index = (apu->noise.index + n) % NOISE_SEQUENCE_LENGTH;
+        apu->noise.shift = noise_sequence[apu->noise.index];
+    }
+    else{
+        for(int i = 0; i < numSamples; i++) noiseGenerator(&apu->noise);
+    }
+
+    // dmc fetches have to happen at the right times
+    for(int i = 0; i < numSamples; i++) dmcGenerator(&apu->dmc);
 }
 
+// time passes with nothing generated
+void skipRun(int numSamples){
+    advanceRun(numSamples);
+
+    // start the high pass from where the slow channels are, so there is
+    // no click when the output comes back
+    int t = apu->tri.period < 2 ? 7 : triangle_sequence[apu->tri.step];
+    apu->dcLastIn = tnd_table[3*t + apu->dmc.output];
+    apu->dcLastOut = 0.0;
+}
+
+// generate numSamples more samples worth of output
+// each sample is 1/sampleRate seconds of time
+// events which occur between samples are applied before the first
+// sample at or after their timestamp, the rest is done in runs.
+// If out is NULL the time passes with nothing generated (audio off).
+void synth(float *out, int numSamples){
+    struct APUEvent e;
+    long long t = 0;
+
+    int i = 0;
+    while(i < numSamples){
+        // register writes and frame sequencer steps, in time order
+        for(;;){
+            int queued = peekAudioEvent(&e, &t);
+            if(queued && t <= apu->frameNext && t <= apu->synthTime){
+                applyAudioEvent(e, t);
+                dequeueAudioEvent();
+            }
+            else if(apu->frameNext <= apu->synthTime){
+                clockFrameSequencer();
+            }
+            else break;
+        }
+
+        long long next = apu->frameNext;
+        if(peekAudioEvent(&e, &t) && t < next) next = t;
+
+        int run = numSamples - i;
+        int n = ceil((next - apu->synthTime) / cyclesPerSample);
+        if(n < run) run = n;
+
+        if(out) synthRun(out + i, run);
+        else skipRun(run);
+        apu->synthTime += run * cyclesPerSample;
+        i += run;
+    }
+}
+
+// catch synth up to the cpu without generating any samples
+void synthSkip(){
+    synth(NULL, apuSamplesPending());
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <time.h>
+
+/* apu microbenchmark
+turns on one channel at a time, holds its note with the halt flags and
+times synth on it. Prints output samples per second per channel, then
+all of them together, and all of them with audio off (no output).
+*/
+
+extern void initAPU();
+extern void apuWrite(int addr, unsigned char byte);
+extern void synth(float *out, int numSamples);
+
+// something that isn't all zeros for the DMC to chew on
+unsigned char dmcFetch(int addr){
+    return (addr * 0x9d) & 0xff;
+}
+
+// nobody snapshots the apu here
+void markDirty(const void *p, int n){
+}
+
+double now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void bench(const char *name, unsigned char channels, int muted){
+    float buf[4096];
+    long total = 0;
+
+    apuWrite(0x4015, channels);
+
+    // notes, with halted length counters so they never end
+    apuWrite(0x4000, 0xbf); apuWrite(0x4002, 0xfd); apuWrite(0x4003, 0x00);
+    apuWrite(0x4004, 0x7f); apuWrite(0x4006, 0x7c); apuWrite(0x4007, 0x01);
+    apuWrite(0x4008, 0xff); apuWrite(0x400a, 0x40); apuWrite(0x400b, 0x00);
+    apuWrite(0x400c, 0x3f); apuWrite(0x400e, 0x04); apuWrite(0x400f, 0x00);
+    apuWrite(0x4010, 0x4f); apuWrite(0x4012, 0x00); apuWrite(0x4013, 0xff);
+
+    synth(buf, 4096);
+
+    double start = now();
+    double elapsed = 0;
+    while(elapsed < 1.0){
+        for(int i = 0; i < 64; i++){
+            synth(muted ? NULL : buf, 4096);
+        }
+        total += 64 * 4096;
+        elapsed = now() - start;
+    }
+
+    printf("%-10s %8.2f M samples/s\n", name, total / elapsed / 1e6);
+}
+
+int main(){
+    initAPU();
+
+    bench("silent", 0x00, 0);
+    bench("square 1", 0x01, 0);
+    bench("square 2", 0x02, 0);
+    bench("triangle", 0x04, 0);
+    bench("noise", 0x08, 0);
+    bench("dmc", 0x10, 0);
+    bench("all", 0x1f, 0);
+    bench("all, off", 0x1f, 1);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* audio sink
+an alternative to the audio device. synth output for a whole run goes to
+a file, either WAV (32 bit float, mono) or raw 32 bit floats. The
+emulation thread only copies samples into blocks and links them onto a
+list. A writer thread takes them off the list and does the disk I/O, so
+the emulation never waits on the disk. Samples are written in host byte
+order, which is the little endian WAV wants on anything we run on.
+*/
+
+#define SINK_BLOCK_SAMPLES 16384
+
+struct SinkBlock {
+    struct SinkBlock *next;
+    int amount;
+    float samples[SINK_BLOCK_SAMPLES];
+};
+
+FILE *sinkFile = NULL;
+int sinkWav = 0;
+int sinkRate = 44100;
+long sinkTotal = 0; // samples handed to the writer so far
+
+struct SinkBlock *sinkFilling = NULL; // only touched by the emulation thread
+struct SinkBlock *sinkHead = NULL; // full blocks waiting for the writer
+struct SinkBlock *sinkTail = NULL;
+int sinkClosing = 0;
+
+pthread_mutex_t sinkMutex;
+pthread_cond_t sinkCond;
+pthread_t sinkThread;
+
+void put16LE(unsigned char *buf, int n){
+    buf[0] = n & 0xff;
+    buf[1] = (n >> 8) & 0xff;
+}
+
+void put32LE(unsigned char *buf, long n){
+    buf[0] = n & 0xff;
+    buf[1] = (n >> 8) & 0xff;
+    buf[2] = (n >> 16) & 0xff;
+    buf[3] = (n >> 24) & 0xff;
+}
+
+#define WAV_HEADER_SIZE 58
+
+// RIFF header, fmt chunk for IEEE float, fact chunk, data chunk header
+void writeWavHeader(FILE *file, int rate, long numSamples){
+    unsigned char hdr[WAV_HEADER_SIZE];
+    long dataSize = numSamples * 4;
+
+    memcpy(hdr + 0, "RIFF", 4);
+    put32LE(hdr + 4, WAV_HEADER_SIZE - 8 + dataSize);
+    memcpy(hdr + 8, "WAVE", 4);
+
+    memcpy(hdr + 12, "fmt ", 4);
+    put32LE(hdr + 16, 18);
+    put16LE(hdr + 20, 3); // WAVE_FORMAT_IEEE_FLOAT
+    put16LE(hdr + 22, 1); // channels
+    put32LE(hdr + 24, rate);
+    put32LE(hdr + 28, rate * 4); // bytes per second
+    put16LE(hdr + 32, 4); // bytes per frame
+    put16LE(hdr + 34, 32); // bits per sample
+    put16LE(hdr + 36, 0); // no extension
+
+    memcpy(hdr + 38, "fact", 4);
+    put32LE(hdr + 42, 4);
+    put32LE(hdr + 46, numSamples);
+
+    memcpy(hdr + 50, "data", 4);
+    put32LE(hdr + 54, dataSize);
+
+    if(fwrite(hdr, 1, WAV_HEADER_SIZE, file) < WAV_HEADER_SIZE){
+        fprintf(stderr, "audio sink: writing WAV header failed: %s\n", strerror(errno));
+    }
+}
+
+void * sinkWriter(void *arg){
+    pthread_mutex_lock(&sinkMutex);
+    for(;;){
+        while(sinkHead == NULL && !sinkClosing){
+            pthread_cond_wait(&sinkCond, &sinkMutex);
+        }
+
+        struct SinkBlock *b = sinkHead;
+        if(b == NULL) break; // closing and nothing left
+
+        sinkHead = b->next;
+        if(sinkHead == NULL) sinkTail = NULL;
+        pthread_mutex_unlock(&sinkMutex);
+
+        size_t n = fwrite(b->samples, sizeof(float), b->amount, sinkFile);
+        if(n < (size_t)b->amount){
+            fprintf(stderr, "audio sink: write failed: %s\n", strerror(errno));
+        }
+        free(b);
+
+        pthread_mutex_lock(&sinkMutex);
+    }
+    pthread_mutex_unlock(&sinkMutex);
+    return NULL;
+}
+
+// wav = 1 for a WAV file, 0 for raw floats. Returns 0 on failure.
+int openAudioSink(const char *path, int wav, int rate){
+    sinkFile = fopen(path, "wb");
+    if(sinkFile == NULL){
+        fprintf(stderr, "audio sink: can't open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    setvbuf(sinkFile, NULL, _IOFBF, 1 << 20);
+
+    sinkWav = wav;
+    sinkRate = rate;
+    sinkTotal = 0;
+    sinkClosing = 0;
+
+    // placeholder, the sizes are filled in on close
+    if(sinkWav) writeWavHeader(sinkFile, sinkRate, 0);
+
+    pthread_mutex_init(&sinkMutex, NULL);
+    pthread_cond_init(&sinkCond, NULL);
+    if(pthread_create(&sinkThread, NULL, sinkWriter, NULL) != 0){
+        fprintf(stderr, "audio sink: can't start writer thread\n");
+        fclose(sinkFile);
+        sinkFile = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+void flushAudioSink(){
+    if(sinkFilling == NULL) return;
+
+    pthread_mutex_lock(&sinkMutex);
+    if(sinkTail) sinkTail->next = sinkFilling;
+    else sinkHead = sinkFilling;
+    sinkTail = sinkFilling;
+    pthread_cond_signal(&sinkCond);
+    pthread_mutex_unlock(&sinkMutex);
+
+    sinkFilling = NULL;
+}
+
+void writeAudioSink(const float *samples, int numSamples){
+    if(sinkFile == NULL) return;
+
+    while(numSamples > 0){
+        if(sinkFilling == NULL){
+            sinkFilling = malloc(sizeof(struct SinkBlock));
+            if(sinkFilling == NULL){
+                fprintf(stderr, "audio sink: out of memory\n");
+                exit(1);
+            }
+            sinkFilling->next = NULL;
+            sinkFilling->amount = 0;
+        }
+
+        int n = SINK_BLOCK_SAMPLES - sinkFilling->amount;
+        if(n > numSamples) n = numSamples;
+        memcpy(sinkFilling->samples + sinkFilling->amount, samples, n * sizeof(float));
+        sinkFilling->amount += n;
+        sinkTotal += n;
+        samples += n;
+        numSamples -= n;
+
+        if(sinkFilling->amount == SINK_BLOCK_SAMPLES) flushAudioSink();
+    }
+}
+
+// waits for the writer to finish, then fixes up the WAV header
+void closeAudioSink(){
+    if(sinkFile == NULL) return;
+
+    flushAudioSink();
+
+    pthread_mutex_lock(&sinkMutex);
+    sinkClosing = 1;
+    pthread_cond_signal(&sinkCond);
+    pthread_mutex_unlock(&sinkMutex);
+
+    pthread_join(sinkThread, NULL);
+    pthread_mutex_destroy(&sinkMutex);
+    pthread_cond_destroy(&sinkCond);
+
+    if(sinkWav){
+        fseek(sinkFile, 0, SEEK_SET);
+        writeWavHeader(sinkFile, sinkRate, sinkTotal);
+    }
+
+    fclose(sinkFile);
+    sinkFile = NULL;
+}
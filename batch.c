@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/* batch runner
+Runs a set of consoles K frames at a time on a pool of threads, for
+workloads that want thousands of them evaluated as fast as possible.
+
+Every console has a home thread, consoles are dealt out to threads in
+contiguous runs. A batch queues each thread's consoles on that thread,
+it runs them K frames each from the front of its queue. A thread that
+runs out steals from the back of someone else's queue, so one slow
+console doesn't hold the batch up. Stealing is only for that batch,
+the next one starts over from the homes, and threads are pinned to
+cores, so a console is almost always run by the same core and its
+state stays in that core's cache.
+
+Each console has an input buffer of 2 bytes per frame, the buttons
+held on controller 1 and 2 (packed like packGamepad). Fill it in before
+runBatch, it's applied one frame at a time. Audio is off, whatever a
+frame makes is thrown away.
+*/
+
+struct Console;
+extern void runFrame(struct Console *c);
+extern void setButtons(struct Console *c, unsigned char pad1, unsigned char pad2);
+extern void synthSkip();
+
+struct BatchQueue {
+    pthread_mutex_t mutex;
+    int *jobs; // the consoles at home on this thread
+    int count;
+    int front; // jobs[front] to jobs[back - 1] are still to run
+    int back;
+    long steals; // jobs taken off this queue by other threads
+};
+
+struct BatchWorker {
+    struct Batch *batch;
+    int id;
+};
+
+struct Batch {
+    struct Console **consoles;
+    unsigned char **input;
+    int numConsoles;
+    int frames;
+
+    int numThreads;
+    int started; // threads created so far
+    pthread_t *threads;
+    struct BatchWorker *workers;
+    struct BatchQueue *queues;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t startCond;
+    pthread_cond_t doneCond;
+    long generation; // bumped to start a batch
+    int running; // threads still working on this batch
+    int quitting;
+};
+
+int batchCores(){
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+void pinThread(int id){
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % batchCores(), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+#endif
+}
+
+// next console for thread id to run, -1 when the batch is used up
+int takeJob(struct Batch *b, int id){
+    struct BatchQueue *q = &b->queues[id];
+    int job = -1;
+
+    pthread_mutex_lock(&q->mutex);
+    if(q->front < q->back) job = q->jobs[q->front++];
+    pthread_mutex_unlock(&q->mutex);
+    if(job >= 0) return job;
+
+    for(int k = 1; k < b->numThreads; k++){
+        q = &b->queues[(id + k) % b->numThreads];
+        pthread_mutex_lock(&q->mutex);
+        if(q->front < q->back){
+            job = q->jobs[--q->back];
+            q->steals++;
+        }
+        pthread_mutex_unlock(&q->mutex);
+        if(job >= 0) return job;
+    }
+
+    return -1;
+}
+
+void runJob(struct Batch *b, int job){
+    struct Console *c = b->consoles[job];
+    unsigned char *in = b->input[job];
+    for(int f = 0; f < b->frames; f++){
+        setButtons(c, in[2*f], in[2*f + 1]);
+        runFrame(c);
+        synthSkip();
+    }
+}
+
+void * batchWorker(void *arg){
+    struct BatchWorker *w = arg;
+    struct Batch *b = w->batch;
+    long seen = 0;
+
+    pinThread(w->id);
+
+    pthread_mutex_lock(&b->mutex);
+    for(;;){
+        while(b->generation == seen && !b->quitting) pthread_cond_wait(&b->startCond, &b->mutex);
+        if(b->quitting) break;
+        seen = b->generation;
+        pthread_mutex_unlock(&b->mutex);
+
+        int job;
+        while((job = takeJob(b, w->id)) >= 0) runJob(b, job);
+
+        pthread_mutex_lock(&b->mutex);
+        b->running--;
+        if(b->running == 0) pthread_cond_signal(&b->doneCond);
+    }
+    pthread_mutex_unlock(&b->mutex);
+
+    return NULL;
+}
+
+void destroyBatch(struct Batch *b);
+
+// a pool of numThreads threads for running consoles framesPerBatch
+// frames at a time. The consoles stay owned by the caller. Returns NULL
+// if out of memory or threads.
+struct Batch *createBatch(struct Console **consoles, int numConsoles, int numThreads, int framesPerBatch){
+    struct Batch *b = calloc(1, sizeof(struct Batch));
+    if(b == NULL) return NULL;
+
+    if(numThreads > numConsoles) numThreads = numConsoles;
+    if(numThreads < 1) numThreads = 1;
+
+    b->consoles = consoles;
+    b->numConsoles = numConsoles;
+    b->frames = framesPerBatch;
+    b->numThreads = numThreads;
+    pthread_mutex_init(&b->mutex, NULL);
+    pthread_cond_init(&b->startCond, NULL);
+    pthread_cond_init(&b->doneCond, NULL);
+
+    b->input = calloc(numConsoles, sizeof(unsigned char *));
+    b->threads = calloc(numThreads, sizeof(pthread_t));
+    b->workers = calloc(numThreads, sizeof(struct BatchWorker));
+    b->queues = calloc(numThreads, sizeof(struct BatchQueue));
+    if(!b->input || !b->threads || !b->workers || !b->queues){
+        destroyBatch(b);
+        return NULL;
+    }
+
+    for(int i = 0; i < numConsoles; i++){
+        b->input[i] = calloc(2 * framesPerBatch, 1);
+        if(b->input[i] == NULL){
+            destroyBatch(b);
+            return NULL;
+        }
+    }
+
+    // thread t is home to consoles first to last - 1
+    for(int t = 0; t < numThreads; t++){
+        struct BatchQueue *q = &b->queues[t];
+        int first = (long)numConsoles * t / numThreads;
+        int last = (long)numConsoles * (t + 1) / numThreads;
+        pthread_mutex_init(&q->mutex, NULL);
+        q->count = last - first;
+        q->jobs = malloc(q->count * sizeof(int));
+        if(q->jobs == NULL){
+            destroyBatch(b);
+            return NULL;
+        }
+        for(int i = 0; i < q->count; i++) q->jobs[i] = first + i;
+    }
+
+    for(int t = 0; t < numThreads; t++){
+        b->workers[t].batch = b;
+        b->workers[t].id = t;
+        if(pthread_create(&b->threads[t], NULL, batchWorker, &b->workers[t]) != 0){
+            fprintf(stderr, "batch: can't start thread %d\n", t);
+            destroyBatch(b);
+            return NULL;
+        }
+        b->started++;
+    }
+
+    return b;
+}
+
+// console i's input for the next batch, 2 bytes per frame
+unsigned char *batchInput(struct Batch *b, int i){
+    return b->input[i];
+}
+
+// run every console framesPerBatch frames, returns when they're all done
+void runBatch(struct Batch *b){
+    pthread_mutex_lock(&b->mutex);
+
+    for(int t = 0; t < b->numThreads; t++){
+        b->queues[t].front = 0;
+        b->queues[t].back = b->queues[t].count;
+    }
+
+    b->running = b->numThreads;
+    b->generation++;
+    pthread_cond_broadcast(&b->startCond);
+    while(b->running > 0) pthread_cond_wait(&b->doneCond, &b->mutex);
+
+    pthread_mutex_unlock(&b->mutex);
+}
+
+// consoles run away from home so far
+long batchSteals(struct Batch *b){
+    long total = 0;
+    for(int t = 0; t < b->numThreads; t++) total += b->queues[t].steals;
+    return total;
+}
+
+void destroyBatch(struct Batch *b){
+    pthread_mutex_lock(&b->mutex);
+    b->quitting = 1;
+    pthread_cond_broadcast(&b->startCond);
+    pthread_mutex_unlock(&b->mutex);
+
+    for(int t = 0; t < b->started; t++) pthread_join(b->threads[t], NULL);
+
+    if(b->queues){
+        for(int t = 0; t < b->numThreads; t++) free(b->queues[t].jobs);
+    }
+    if(b->input){
+        for(int i = 0; i < b->numConsoles; i++) free(b->input[i]);
+    }
+    free(b->input);
+    free(b->threads);
+    free(b->workers);
+    free(b->queues);
+    free(b);
+}
@@ -0,0 +1,93 @@
+#include <stddef.h>
+
+/* xxHash64
+Yann Collet's fast non-cryptographic hash, the 64 bit one. This follows
+the reference algorithm, so hashes match other xxh64 implementations.
+Used to fingerprint the machine every frame, a few K in a couple of
+microseconds.
+*/
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+unsigned long long rotl64(unsigned long long x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+// little endian loads, a byte at a time so alignment doesn't matter
+unsigned long long read32(const unsigned char *p){
+    return (unsigned long long)p[0] | (unsigned long long)p[1] << 8 | (unsigned long long)p[2] << 16 | (unsigned long long)p[3] << 24;
+}
+
+unsigned long long read64(const unsigned char *p){
+    return read32(p) | read32(p + 4) << 32;
+}
+
+unsigned long long xxhRound(unsigned long long acc, unsigned long long input){
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+unsigned long long xxhMerge(unsigned long long acc, unsigned long long v){
+    acc ^= xxhRound(0, v);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+unsigned long long xxh64(const void *data, size_t n, unsigned long long seed){
+    const unsigned char *p = data;
+    const unsigned char *end = p + n;
+    unsigned long long h;
+
+    if(n >= 32){
+        unsigned long long v1 = seed + PRIME64_1 + PRIME64_2;
+        unsigned long long v2 = seed + PRIME64_2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - PRIME64_1;
+
+        do{
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p + 8));
+            v3 = xxhRound(v3, read64(p + 16));
+            v4 = xxhRound(v4, read64(p + 24));
+            p += 32;
+        } while(end - p >= 32);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    }
+    else{
+        h = seed + PRIME64_5;
+    }
+
+    h += n;
+
+    while(end - p >= 8){
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if(end - p >= 4){
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while(p < end){
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
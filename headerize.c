@@ -11,7 +11,7 @@ void dumpRom(const char *path){
     int nread;
     unsigned char buf[16];
     int total = 0;
-    printf("unsigned char rom[2561 * 16] = {\n");
+    printf("unsigned char rom[] = {\n");
     for(;;){
         nread = fread(buf, 1, 16, file);
         if(nread < 0){
@@ -19,6 +19,7 @@ void dumpRom(const char *path){
             exit(1);
         }
         if(nread == 0) break;
+        if(total > 0) printf(",\n");
         total += nread;
         printf("\t");
         for(int i=0; i < nread; i++){
@@ -29,14 +30,9 @@ void dumpRom(const char *path){
             else printf("%3d", c);
             if(i != nread - 1) printf(",");
         }
-        if(total == 40976){
-            printf("\n};\n");
-            break;
-        }
-        else{
-            printf(",\n");
-        }
     }
+    printf("\n};\n");
+    fclose(file);
 }
 
 int main(int argc, char * argv[]){
@@ -3,50 +3,91 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <math.h>
 #include <errno.h>
-#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include <raylib.h>
 
+#ifdef EMBEDDED_ROM
 #include <rom.h>
+#endif
 #include <instructions.h>
 #include <colors.h>
 
 #define APP_NAME "mario"
 
-extern void setEnable(int ch, unsigned char en);
-extern void setVolume(int ch, unsigned char vol);
-extern void setDutyCycle(int ch, unsigned char d);
-extern void setEnvelope(int ch, unsigned char byte);
-extern void setSweep(int ch, unsigned char byte);
-extern void setLengthCounter(int ch, unsigned char n);
-extern void setTimerLow(int ch, unsigned char byte);
-extern void setTimerHigh(int ch, unsigned char byte);
+extern void apuWrite(int addr, unsigned char byte);
+extern int apuSamplesPending();
+extern void apuClock(int cycles);
+extern void apuAttach(void *state, int size);
 extern void synth(float *out, int numSamples);
-extern void apuFrameHalfClock();
-extern void setFrameCounterPeriod(unsigned char bit);
-
-extern FILE * openSaveFileForWriting(const char * appname, const char * filename);
-extern FILE * openSaveFileForReading(const char * appname, const char * filename);
-
-unsigned char memory[65536];
+extern void synthSkip();
+extern void initAPU();
+extern void setSampleRate(int rate);
+extern const char * apuFieldAt(int offset);
+extern unsigned long long apuHash(unsigned long long seed);
+extern void apuHotBytes(int *start, int *end);
+
+extern int openAudioSink(const char *path, int wav, int rate);
+extern void writeAudioSink(const float *samples, int numSamples);
+extern void closeAudioSink();
+
+extern void initRewind(int snapSize, int arenaSize);
+extern void rewindPush(const unsigned char *snap);
+extern int rewindPop(unsigned char *snap);
+extern int rewindFrames();
+extern long rewindBytes();
+extern double rewindAveragePush();
+extern double rewindLastPush;
+extern double rewindMaxPush;
+
+extern void writeSaveFile(const char *appname, const char *filename, const unsigned char *machine, int machineSize, unsigned long romCrc);
+extern int readSaveFile(const char *appname, const char *filename, unsigned char *machine, int machineSize, unsigned long romCrc);
+extern void flushSaveFiles();
+extern int saveFileExists(const char *appname, const char *filename);
+extern const unsigned char * mapFile(const char *path, size_t *size);
+extern void unmapFile(const unsigned char *data, size_t size);
+extern void writeRomCache(const char *appname, unsigned long long romHash, const unsigned char *tiles, long length);
+extern const unsigned char * mapRomCache(const char *appname, unsigned long long romHash, long length, const unsigned char **image, size_t *size);
+struct Console;
+struct Batch;
+extern struct Batch *createBatch(struct Console **consoles, int numConsoles, int numThreads, int framesPerBatch);
+extern unsigned char *batchInput(struct Batch *b, int i);
+extern void runBatch(struct Batch *b);
+extern long batchSteals(struct Batch *b);
+extern void destroyBatch(struct Batch *b);
+extern int batchCores();
+struct Movie;
+extern struct Movie * newMovie(int snapSize, int keyInterval, int start);
+extern void freeMovie(struct Movie *m);
+extern void movieLatch(struct Movie *m, int frame, unsigned char *pad1, unsigned char *pad2);
+extern int movieInput(struct Movie *m, int frame, unsigned char *pad1, unsigned char *pad2);
+extern int movieKeyDue(struct Movie *m, int frame);
+extern void movieAddKey(struct Movie *m, int frame, const unsigned char *snap);
+extern int movieFindKey(struct Movie *m, int frame, unsigned char *snap);
+extern void movieTruncate(struct Movie *m, int frame);
+extern int movieStart(struct Movie *m);
+extern int movieEnd(struct Movie *m);
+extern int moviePlaying(struct Movie *m);
+extern int movieCheckHash(struct Movie *m, int frame, unsigned long long hash);
+extern void saveMovie(struct Movie *m, const char *path, unsigned long romCrc);
+extern struct Movie * loadMovie(const char *path, int snapSize, unsigned long romCrc);
+extern unsigned long crc32Update(unsigned long crc, const unsigned char *data, size_t n);
+extern unsigned long long xxh64(const void *data, size_t n, unsigned long long seed);
 
 int timeDilation = 1;
 int timeFreeze = 0;
 
-int dmaFlag = 0;
-
-int frameNo = 0;
-int scanline = 0;
-int dot = 0;
-
+// debug traces of whatever machine this thread is running
 #define WRITELOG_SIZE 64
-int writeLog[WRITELOG_SIZE];
-int writeLogPtr = 0;
+_Thread_local int writeLog[WRITELOG_SIZE];
+_Thread_local int writeLogPtr = 0;
 
-int pcLog[8] = {0,0,0,0,0,0,0,0};
-int pcLogPtr = 0;
+_Thread_local int pcLog[8] = {0,0,0,0,0,0,0,0};
+_Thread_local int pcLogPtr = 0;
 
 void remember(int pc){
     pcLog[pcLogPtr] = pc;
@@ -72,14 +113,6 @@ void logWrite(int addr){
     }
 }
 
-struct InterruptVectors {
-    int nmi;
-    int reset;
-    int irq;
-};
-
-struct InterruptVectors vectors;
-
 struct ProcessorStatus {
     int carry;
     int zero;
@@ -157,19 +190,6 @@ struct Registers {
     struct ProcessorStatus P;
 };
 
-struct Registers regs = {0,0,0,0xfd,0,{0,0,1,0,0,0}};
-
-struct NESHeader {
-    unsigned char start[4];
-    unsigned char prg_rom_size;
-    unsigned char chr_rom_size;
-    unsigned char flags6;
-    unsigned char flags7;
-    unsigned char flags8;
-    unsigned char flags9;
-    unsigned char flags10;
-    unsigned char unused[5];
-};
 
 int screenW = 320;
 int screenH = 240;
@@ -177,28 +197,54 @@ int screenScale = 3;
 Image screenImg;
 Texture2D screenTex;
 
-// $0000 - $1fff the CHR ROM
+// ppu address space
+// $0000 - $1fff the CHR ROM or RAM (subject to bank switching)
 // $2000 - $2fff vram nametables (subject to mirroring)
-// $3000 - $3eff unused
+// $3000 - $3eff mirror of $2000 - $2eff
 // $3f00 - $3f1f palette RAM indexes
 // $3f20 - $3fff mirrors
-#define VRAM_SIZE 0x4000
 #define VRAM_MAX  0x3fff
-unsigned char ppuMemory[VRAM_SIZE];
-unsigned char oam[256]; // 64 x 4 bytes
-int ppuAddr = 0; // also used for ppuV, internal scroll position
-int oamAddr = 0;
-int ppuT = 0; // internal coarse-x scroll position
-int ppuX = 0; // internal fine-x scroll position
-int ppuW = 0; // write toggle
-int ppuScrollX = 0;
-int ppuScrollY = 0;
-int ppuNameBase = 0x2000;
-int ppuFineX = 0;
-unsigned char ppuDataReadBuffer = 0;
-
-struct OAMEntry spriteOutputUnit[8];
-int numSprites = 0;
+
+// the cartridge. It never changes so it isn't part of the machine state,
+// every console reads the same copy, straight out of the rom file. What
+// part of it shows up where is up to the mapper.
+const unsigned char *prgRom;
+const unsigned char *chrRom; // NULL on boards with CHR RAM
+
+// the board the cartridge is built on, see mappers
+struct Mapper {
+    int number;
+    const char *name;
+    void (*reset)();
+    void (*write)(int addr, unsigned char byte); // to $8000 - $ffff
+    void (*banks)(); // point the page tables at the banks the registers select
+    void (*scanline)(); // once per rendered scanline, or NULL
+};
+
+const struct Mapper *cartMapper;
+
+// mapper registers in the machine, what each one means is up to the mapper
+#define MIRROR_HORIZONTAL 0
+#define MIRROR_VERTICAL 1
+#define MIRROR_FOUR_SCREEN 2
+#define MIRROR_SINGLE_LOW 3
+#define MIRROR_SINGLE_HIGH 4
+
+struct MapperState {
+    int mirroring; // MIRROR_*
+    int bank[8]; // bank registers
+    int control; // MMC1 control, MMC3 bank select
+    int shift; // MMC1 serial port
+    int shiftCount;
+    int irqLatch; // MMC3 scanline counter
+    int irqCounter;
+    int irqReload;
+    int irqEnabled;
+    int irq; // holding the cpu's irq line
+};
+
+_Thread_local struct OAMEntry spriteOutputUnit[8];
+_Thread_local int numSprites = 0;
 
 struct PPUCtrl {
     int nametableBase;
@@ -227,10 +273,6 @@ struct PPUStatus {
     int inVblank;
 };
 
-unsigned char ppuCtrlByte;
-struct PPUCtrl ppuCtrl = {0,0,0,0,0,0,0};
-struct PPUMask ppuMask = {0,0,0,0,0,0,0,0};
-struct PPUStatus ppuStatus = {0,0,0};
 
 struct GamepadBits {
     int A;
@@ -246,91 +288,288 @@ struct GamepadBits {
 
 unsigned char packGamepad(struct GamepadBits *);
 
-struct GamepadBits gamepad1;
-struct GamepadBits gamepad2;
+/* machine state
+Everything the emulated NES changes as it runs is in here, and nothing
+else is. There are no pointers in it, so a snapshot is a memcpy of the
+struct and restoring one is a memcpy back. The apu keeps its own state
+struct (apu.c) in the space reserved for it at the end.
+
+Bump MACHINE_VERSION when the layout changes, snapshots from another
+version are refused.
+*/
+#define MACHINE_VERSION 5
+#define APU_STATE_SIZE 3072
+
+struct Machine {
+    int version;
+    int size; // sizeof(struct Machine)
+
+    // cpu
+    struct Registers regs;
+    int nmiComing;
+    int nmiHappening;
+    int cpuDots; // dots until the current instruction is done
+    int dmaFlag;
+
+    // ppu
+    int frameNo;
+    int scanline;
+    int dot;
+    int ppuAddr; // also used for ppuV, internal scroll position
+    int oamAddr;
+    int ppuT; // internal coarse-x scroll position
+    int ppuX; // internal fine-x scroll position
+    int ppuW; // write toggle
+    int ppuScrollX;
+    int ppuScrollY;
+    int ppuNameBase;
+    int ppuFineX;
+    unsigned char ppuDataReadBuffer;
+    unsigned char ppuCtrlByte;
+    struct PPUCtrl ppuCtrl;
+    struct PPUMask ppuMask;
+    struct PPUStatus ppuStatus;
+
+    // background renderer
+    int coarseX;
+    struct RGB slicePalette[4]; // 0 1 2 or 3
+    int renderTable; // the nametable being drawn, 0 to 3
+    unsigned char sliceQueue0; // up to 8 bits, dequeue 2 at a time
+    unsigned char sliceQueue1; // up to 8 bits, dequeue 2 at a time
+    int sliceQueueSize; // number of pairs of bits
+
+    // controllers
+    unsigned char gamepadShiftRegister1;
+    unsigned char gamepadShiftRegister2;
+
+    // cartridge
+    struct MapperState mapper;
+
+    // memories, together so the registers above are a few pages of their
+    // own (see dirty pages)
+    unsigned char ram[0x800]; // $0000 - $07ff, mirrored up to $1fff
+    unsigned char vram[0x800]; // two nametables
+    unsigned char palette[0x20];
+    unsigned char oam[256]; // 64 x 4 bytes
+    unsigned char prgRam[0x2000]; // $6000 - $7fff
+    unsigned char chrRam[0x2000]; // ppu $0000 - $1fff on boards without CHR ROM
+
+    // apu.c's struct APU lives here
+    _Alignas(8) unsigned char apu[APU_STATE_SIZE];
+};
+
+// dirty page tracking, see markDirty
+#define DIRTY_PAGE_SHIFT 6
+#define DIRTY_PAGE_SIZE (1 << DIRTY_PAGE_SHIFT)
+#define MACHINE_PAGES ((int)((sizeof(struct Machine) + DIRTY_PAGE_SIZE - 1) / DIRTY_PAGE_SIZE))
+#define PAGE_WORDS ((MACHINE_PAGES + 63) / 64)
+
+// snapshots kept up to date a page at a time
+#define TRACK_REWIND 0
+#define TRACK_RUNAHEAD 1
+#define TRACK_FRAME 2 // not a snapshot, counts pages written per frame
+#define TRACKS 3
+
+const struct Machine machinePowerOn = {
+    .version = MACHINE_VERSION,
+    .size = sizeof(struct Machine),
+    .regs = {0,0,0,0xfd,0,{0,0,1,0,0,0}},
+    .cpuDots = 1,
+    .ppuNameBase = 0x2000
+};
+
+/* consoles
+A console is a machine plus what's plugged into it, the controllers and
+maybe a screen to draw on. Without one the ppu does the work that
+changes the machine and skips making pixels, and a console is just
+sizeof(struct Console), about 24K. Any number of them can exist, each
+one is created, run and destroyed on its own. They share the cartridge,
+readRom loads it once for all of them.
+
+The emulator core works on the console selected on the current thread,
+through console and nes. Every thread has its own selection, so threads
+can run different consoles at the same time. A console must only be run
+by one thread at a time.
+*/
+struct Console {
+    struct Machine machine;
+    struct GamepadBits gamepad1;
+    struct GamepadBits gamepad2;
+    unsigned char *screen; // screenW x screenH RGBA, or NULL to not draw
+    struct Movie *movie; // being recorded or played, see movie.c
+    int speculative; // running frames that will be undone, see run-ahead
+
+    // where the mapper has put the cartridge's banks, see mappers. These
+    // point into the rom or this console's machine, so they aren't part of
+    // it, mapBanks rebuilds them from the mapper registers.
+    const unsigned char *prgPage[4]; // $8000 - $ffff, 8K each
+    const unsigned char *ppuPage[16]; // ppu $0000 - $3fff, 1K each
+
+    // pages written to, one bit each, see markDirty
+    unsigned long long dirty[PAGE_WORDS]; // not handed to the tracks yet
+    unsigned long long pending[TRACKS][PAGE_WORDS]; // since each track caught up
+    unsigned char synced[TRACKS]; // the track's snapshot has been taken
+};
+
+// the console the window shows
+struct Console mainConsole;
+
+_Thread_local struct Console *console = &mainConsole;
+_Thread_local struct Machine *nes = &mainConsole.machine;
+
+/* dirty pages
+The machine is cut into DIRTY_PAGE_SIZE byte pages. A frame of play
+writes to a few of them, mostly the same few: the zero page, the stack,
+the sprite buffer, a row of nametable. The big arrays (ram, vram,
+palette, oam and the apu's event queue) set their page's bit in dirty
+whenever they're stored to. Pages holding anything else (registers, ppu
+and apu state) change every frame anyway and are always copied.
+
+A snapshot that's kept around and taken again and again, like the one
+run-ahead goes back to, has a track. snapshotChanges only copies the
+pages written since that track's last snapshot, restoreChanges only
+copies back the ones written since.
+*/
+
+unsigned long long pageAlways[PAGE_WORDS]; // the pages that are always copied
+unsigned long long pageAll[PAGE_WORDS];
+int pagesTracked; // pages that aren't always copied
+int pageTablesReady = 0;
+
+void initPageTables(){
+    if(pageTablesReady) return;
+
+    int hotStart, hotEnd;
+    apuHotBytes(&hotStart, &hotEnd);
+
+    // byte ranges that are only stored to through markDirty: the memories
+    // up to the apu's event queue, and the apu's unused space
+    int ram = offsetof(struct Machine, ram);
+    int apu = offsetof(struct Machine, apu);
+    int ranges[2][2] = {
+        {ram, apu + hotStart - ram},
+        {apu + hotEnd, APU_STATE_SIZE - hotEnd}
+    };
+
+    pagesTracked = 0;
+    for(int i = 0; i < MACHINE_PAGES; i++){
+        int start = i * DIRTY_PAGE_SIZE;
+        int end = start + DIRTY_PAGE_SIZE;
+        int always = 1;
+        for(int r = 0; r < 2; r++){
+            if(start >= ranges[r][0] && end <= ranges[r][0] + ranges[r][1]) always = 0;
+        }
+        if(always) pageAlways[i / 64] |= 1ULL << (i % 64);
+        else pagesTracked++;
+        pageAll[i / 64] |= 1ULL << (i % 64);
+    }
+
+    pageTablesReady = 1;
+}
+
+// n bytes at p in the machine were just stored to
+void markDirty(const void *p, int n){
+    long offset = (const unsigned char *)p - (const unsigned char *)nes;
+    if(offset < 0 || offset + n > (long)sizeof(struct Machine)) return;
+    for(long i = offset >> DIRTY_PAGE_SHIFT; i <= (offset + n - 1) >> DIRTY_PAGE_SHIFT; i++){
+        console->dirty[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+// the whole machine was replaced
+void markAllDirty(){
+    initPageTables();
+    for(int t = 0; t < TRACKS; t++){
+        for(int w = 0; w < PAGE_WORDS; w++) console->pending[t][w] = pageAll[w];
+    }
+}
+
+void storeRam(int addr, unsigned char byte){
+    nes->ram[addr] = byte;
+    int page = (offsetof(struct Machine, ram) + addr) >> DIRTY_PAGE_SHIFT;
+    console->dirty[page / 64] |= 1ULL << (page % 64);
+}
 
-unsigned char gamepadShiftRegister1 = 0;
-unsigned char gamepadShiftRegister2 = 0;
 void pollGamepad(){
 
     if(IsGamepadAvailable(0)){
 
-        gamepad1.A =
+        console->gamepad1.A =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_RIGHT_FACE_DOWN) ||
             IsKeyDown(KEY_K);
-        gamepad1.B =
+        console->gamepad1.B =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_RIGHT_FACE_LEFT) ||
             IsKeyDown(KEY_J);
-        gamepad1.select =
+        console->gamepad1.select =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_MIDDLE_LEFT) ||
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_RIGHT_TRIGGER_1) ||
             IsKeyDown(KEY_Q);
-        gamepad1.start =
+        console->gamepad1.start =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_MIDDLE_RIGHT) ||
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_MIDDLE) ||
             IsKeyDown(KEY_E);
-        gamepad1.up =
+        console->gamepad1.up =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_LEFT_FACE_UP) ||
             GetGamepadAxisMovement(0, GAMEPAD_AXIS_LEFT_Y) > 0.5 ||
             IsKeyDown(KEY_W);
-        gamepad1.down =
+        console->gamepad1.down =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_LEFT_FACE_DOWN) ||
             GetGamepadAxisMovement(0, GAMEPAD_AXIS_LEFT_Y) < -0.5 ||
             IsKeyDown(KEY_S);
-        gamepad1.left =
+        console->gamepad1.left =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_LEFT_FACE_LEFT) ||
             GetGamepadAxisMovement(0, GAMEPAD_AXIS_LEFT_X) < -0.5 ||
             IsKeyDown(KEY_A);
-        gamepad1.right =
+        console->gamepad1.right =
             IsGamepadButtonDown(0, GAMEPAD_BUTTON_LEFT_FACE_RIGHT) ||
             GetGamepadAxisMovement(0, GAMEPAD_AXIS_LEFT_X) > 0.5 ||
             IsKeyDown(KEY_D);
 
     }
     else{
-        gamepad1.A = IsKeyDown(KEY_K);
-        gamepad1.B = IsKeyDown(KEY_J);
-        gamepad1.select = IsKeyDown(KEY_Q);
-        gamepad1.start = IsKeyDown(KEY_E);
-        gamepad1.up = IsKeyDown(KEY_W);
-        gamepad1.down = IsKeyDown(KEY_S);
-        gamepad1.left = IsKeyDown(KEY_A);
-        gamepad1.right = IsKeyDown(KEY_D);
+        console->gamepad1.A = IsKeyDown(KEY_K);
+        console->gamepad1.B = IsKeyDown(KEY_J);
+        console->gamepad1.select = IsKeyDown(KEY_Q);
+        console->gamepad1.start = IsKeyDown(KEY_E);
+        console->gamepad1.up = IsKeyDown(KEY_W);
+        console->gamepad1.down = IsKeyDown(KEY_S);
+        console->gamepad1.left = IsKeyDown(KEY_A);
+        console->gamepad1.right = IsKeyDown(KEY_D);
     }
 
     if(IsGamepadAvailable(1)){
 
-        gamepad2.A = IsGamepadButtonDown(1, GAMEPAD_BUTTON_RIGHT_FACE_DOWN);
-        gamepad2.B = IsGamepadButtonDown(1, GAMEPAD_BUTTON_RIGHT_FACE_LEFT);
-        gamepad2.select =
+        console->gamepad2.A = IsGamepadButtonDown(1, GAMEPAD_BUTTON_RIGHT_FACE_DOWN);
+        console->gamepad2.B = IsGamepadButtonDown(1, GAMEPAD_BUTTON_RIGHT_FACE_LEFT);
+        console->gamepad2.select =
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_MIDDLE_LEFT) ||
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_RIGHT_TRIGGER_2);
-        gamepad2.start =
+        console->gamepad2.start =
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_MIDDLE_RIGHT) ||
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_MIDDLE);
-        gamepad2.up =
+        console->gamepad2.up =
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_LEFT_FACE_UP) ||
             GetGamepadAxisMovement(1, GAMEPAD_AXIS_LEFT_Y) > 0.5;
-        gamepad2.down =
+        console->gamepad2.down =
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_LEFT_FACE_DOWN) ||
             GetGamepadAxisMovement(1, GAMEPAD_AXIS_LEFT_Y) < -0.5;
-        gamepad2.left =
+        console->gamepad2.left =
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_LEFT_FACE_LEFT) ||
             GetGamepadAxisMovement(1, GAMEPAD_AXIS_LEFT_X) < -0.5;
-        gamepad2.right =
+        console->gamepad2.right =
             IsGamepadButtonDown(1, GAMEPAD_BUTTON_LEFT_FACE_RIGHT) ||
             GetGamepadAxisMovement(1, GAMEPAD_AXIS_LEFT_X) > 0.5;
 
     }
     else{
-        gamepad2.A = 0;
-        gamepad2.B = 0;
-        gamepad2.select = 0;
-        gamepad2.start = 0;
-        gamepad2.up = 0;
-        gamepad2.down = 0;
-        gamepad2.left = 0;
-        gamepad2.right = 0;
+        console->gamepad2.A = 0;
+        console->gamepad2.B = 0;
+        console->gamepad2.select = 0;
+        console->gamepad2.start = 0;
+        console->gamepad2.up = 0;
+        console->gamepad2.down = 0;
+        console->gamepad2.left = 0;
+        console->gamepad2.right = 0;
     }
 
 }
@@ -350,12 +589,28 @@ unsigned char packGamepad(struct GamepadBits *gp){
 }
 
 
+void unpackGamepad(unsigned char byte, struct GamepadBits *gp){
+    gp->A = byte & 1;
+    gp->B = (byte >> 1) & 1;
+    gp->select = (byte >> 2) & 1;
+    gp->start = (byte >> 3) & 1;
+    gp->up = (byte >> 4) & 1;
+    gp->down = (byte >> 5) & 1;
+    gp->left = (byte >> 6) & 1;
+    gp->right = (byte >> 7) & 1;
+}
+
+// hold down buttons on c's controllers, packed like packGamepad
+void setButtons(struct Console *c, unsigned char pad1, unsigned char pad2){
+    unpackGamepad(pad1, &c->gamepad1);
+    unpackGamepad(pad2, &c->gamepad2);
+}
 
 void findSpritesOnLine(int line){
     // clear the spriteOutputUnits and load up to 8 on the given line
     numSprites = 0;
     for(int i = 0; i < 16; i++){
-        unsigned char *ptr = &oam[i*4];
+        unsigned char *ptr = &nes->oam[i*4];
         int y = ptr[0];
         // this is ignoring priority
         if(line <= y && y <= line + 7){
@@ -373,49 +628,56 @@ unsigned char read2002() {
 
     unsigned char out = 0;
 
-    out |= (ppuStatus.inVblank << 7);
-    out |= (ppuStatus.spriteZeroHit << 6);
-    out |= (ppuStatus.spriteOverflow << 5);
-    ppuStatus.inVblank = 0;
-    ppuW = 0;
+    out |= (nes->ppuStatus.inVblank << 7);
+    out |= (nes->ppuStatus.spriteZeroHit << 6);
+    out |= (nes->ppuStatus.spriteOverflow << 5);
+    nes->ppuStatus.inVblank = 0;
+    nes->ppuW = 0;
 
     return out;
 }
 
 void write2000(unsigned char byte) {
-    ppuCtrlByte = byte;
-    ppuCtrl.nmiOutput = (byte >> 7) & 1; // might have immediate effect
-    ppuCtrl.extMaster = (byte >> 6) & 1;
-    ppuCtrl.spriteSize = (byte >> 5) & 1; // 8x8 or 8x16
-    ppuCtrl.bgPatternAddress = (byte >> 4) & 1; // 0000 or 1000
-    ppuCtrl.spritePatternAddress = (byte >> 3) & 1; // 0000 or 1000
-    ppuCtrl.vramAddressIncrement = (byte >> 2) & 1; // add 1 or add 32
-    ppuCtrl.nametableBase = byte & 0x03; // 2000, 2400, 2800, or 2c00
-
-    switch(ppuCtrl.nametableBase){
-        case 0: ppuNameBase = 0x2000; break;
-        case 1: ppuNameBase = 0x2400; break;
-        case 2: ppuNameBase = 0x2800; break;
-        case 3: ppuNameBase = 0x2c00; break;
+    nes->ppuCtrlByte = byte;
+    nes->ppuCtrl.nmiOutput = (byte >> 7) & 1; // might have immediate effect
+    nes->ppuCtrl.extMaster = (byte >> 6) & 1;
+    nes->ppuCtrl.spriteSize = (byte >> 5) & 1; // 8x8 or 8x16
+    nes->ppuCtrl.bgPatternAddress = (byte >> 4) & 1; // 0000 or 1000
+    nes->ppuCtrl.spritePatternAddress = (byte >> 3) & 1; // 0000 or 1000
+    nes->ppuCtrl.vramAddressIncrement = (byte >> 2) & 1; // add 1 or add 32
+    nes->ppuCtrl.nametableBase = byte & 0x03; // 2000, 2400, 2800, or 2c00
+
+    switch(nes->ppuCtrl.nametableBase){
+        case 0: nes->ppuNameBase = 0x2000; break;
+        case 1: nes->ppuNameBase = 0x2400; break;
+        case 2: nes->ppuNameBase = 0x2800; break;
+        case 3: nes->ppuNameBase = 0x2c00; break;
     }
 }
 
 void write2001(unsigned char byte) {
-    ppuMask.emphasisB = (byte >> 7) & 1;
-    ppuMask.emphasisG = (byte >> 6) & 1;
-    ppuMask.emphasisR = (byte >> 5) & 1;
-    ppuMask.showSprites = (byte >> 4) & 1;
-    ppuMask.showBackground = (byte >> 3) & 1;
-    ppuMask.showSpritesLeft = (byte >> 2) & 1;
-    ppuMask.showBackgroundLeft = (byte >> 1) & 1;
-    ppuMask.grayscale = (byte >> 0) & 1;
+    nes->ppuMask.emphasisB = (byte >> 7) & 1;
+    nes->ppuMask.emphasisG = (byte >> 6) & 1;
+    nes->ppuMask.emphasisR = (byte >> 5) & 1;
+    nes->ppuMask.showSprites = (byte >> 4) & 1;
+    nes->ppuMask.showBackground = (byte >> 3) & 1;
+    nes->ppuMask.showSpritesLeft = (byte >> 2) & 1;
+    nes->ppuMask.showBackgroundLeft = (byte >> 1) & 1;
+    nes->ppuMask.grayscale = (byte >> 0) & 1;
 }
 
 
 
+unsigned char peekMemory(int addr);
+
+// the 16 bit address stored at addr, $fffa nmi, $fffc reset, $fffe irq
+int vectorAt(int addr){
+    return (peekMemory(addr + 1) << 8) | peekMemory(addr);
+}
+
 void resetCPU(){
-    regs.P.interruptDisable = 1;
-    regs.PC = vectors.reset;
+    nes->regs.P.interruptDisable = 1;
+    nes->regs.PC = vectorAt(0xfffc);
 }
 
 void printBits(int byte){
@@ -514,36 +776,75 @@ char * locationName(int addr){
     }
 }
 
+// the instructions table by opcode, the first entry for each. Filled in
+// by main before any console runs, threads only read it.
+struct Instruction *opcodeTable[256];
+
+void initOpcodeTable(){
+    for(int i = 255; i >= 0; i--) opcodeTable[instructions[i].opcode & 0xff] = &instructions[i];
+}
+
 struct Instruction * instructionFromOpcode(int opcode){
-    struct Instruction *ptr = &instructions[0];
-    for(int i = 0; i < 256; i++){
-        if(ptr->opcode == opcode) return ptr;
-        ptr++;
-    }
+    struct Instruction *ptr = opcodeTable[opcode & 0xff];
+    if(ptr && ptr->opcode == opcode) return ptr;
     printf("unknown opcode (%02x)\n", opcode);
     exit(1);
 }
 
+// read without side effects, for instruction fetch and debug displays
+unsigned char peekMemory(int addr){
+    if(addr >= 0x8000) return console->prgPage[(addr >> 13) & 3][addr & 0x1fff];
+    if(addr < 0x2000) return nes->ram[addr & 0x7ff];
+    if(addr >= 0x6000) return nes->prgRam[addr & 0x1fff];
+    return 0;
+}
+
+// vram reads and writes through $2007
+unsigned char ppuRead(int addr){
+    if(addr < 0x3f00) return console->ppuPage[(addr >> 10) & 15][addr & 0x3ff];
+    return nes->palette[addr & 0x1f];
+}
+
+void ppuWrite(int addr, unsigned char byte){
+    unsigned char *p;
+    if(addr < 0x2000 && chrRom){
+        return; // CHR ROM
+    }
+    else if(addr < 0x3f00){
+        // CHR RAM or a nametable, both in the machine
+        p = (unsigned char *)console->ppuPage[(addr >> 10) & 15] + (addr & 0x3ff);
+    }
+    // this piece of palette memory is mirrored.
+    else if(addr == 0x3f10){
+        p = &nes->palette[0];
+    }
+    else{
+        p = &nes->palette[addr & 0x1f];
+    }
+    *p = byte;
+    markDirty(p, 1);
+}
+
 void printInstruction(int addr){
-    int opcode = memory[addr];
+    int opcode = peekMemory(addr);
     struct Instruction * ins = instructionFromOpcode(opcode);
     printf("%s", ins->mnemonic);
-    if(ins->size == 3) printf(" %02x %02x", memory[addr+1], memory[addr+2]);
-    if(ins->size == 2) printf(" %02x", memory[addr+1]);
+    if(ins->size == 3) printf(" %02x %02x", peekMemory(addr+1), peekMemory(addr+2));
+    if(ins->size == 2) printf(" %02x", peekMemory(addr+1));
     printf("\n");
 }
 
 void debug(){
-    int opcode = memory[regs.PC];
+    int opcode = peekMemory(nes->regs.PC);
     struct Instruction * ins = instructionFromOpcode(opcode);
     printf(
         "PC=%04x %s(%d) A=%02x Y=%02x X=%02x S=%02x [",
-        regs.PC, ins->mnemonic, ins->size, regs.A, regs.Y, regs.X, regs.S
+        nes->regs.PC, ins->mnemonic, ins->size, nes->regs.A, nes->regs.Y, nes->regs.X, nes->regs.S
     );
-    for(int i = regs.S+1; i < 256; i++){
-        printf("%02x,", memory[0x0100 + i]);
+    for(int i = nes->regs.S+1; i < 256; i++){
+        printf("%02x,", nes->ram[0x0100 + i]);
     }
-    struct ProcessorStatus p = regs.P;
+    struct ProcessorStatus p = nes->regs.P;
     printf(
         "] (c%d z%d i%d d%d o%d n%d))\n",
         p.carry, p.zero, p.interruptDisable, p.decimal, p.overflow, p.negative
@@ -553,29 +854,29 @@ void debug(){
 }
 
 void showCPU(){
-    printf("A = $%02x\n", regs.A);
-    printf("X = $%02x\n", regs.X);
-    printf("Y = $%02x\n", regs.Y);
-    printf("S = $%02x\n", regs.S);
-    printf("PC = $%04x\n", regs.PC);
-    printf("carry = %d\n", regs.P.carry);
-    printf("zero = %d\n", regs.P.zero);
-    printf("interruptDisable = %d\n", regs.P.interruptDisable);
-    printf("decimal = %d\n", regs.P.decimal);
-    printf("overflow = %d\n", regs.P.overflow);
-    printf("negative = %d\n", regs.P.negative);
+    printf("A = $%02x\n", nes->regs.A);
+    printf("X = $%02x\n", nes->regs.X);
+    printf("Y = $%02x\n", nes->regs.Y);
+    printf("S = $%02x\n", nes->regs.S);
+    printf("PC = $%04x\n", nes->regs.PC);
+    printf("carry = %d\n", nes->regs.P.carry);
+    printf("zero = %d\n", nes->regs.P.zero);
+    printf("interruptDisable = %d\n", nes->regs.P.interruptDisable);
+    printf("decimal = %d\n", nes->regs.P.decimal);
+    printf("overflow = %d\n", nes->regs.P.overflow);
+    printf("negative = %d\n", nes->regs.P.negative);
     printf("instruction @ PC:\n");
-    printInstruction(regs.PC);
+    printInstruction(nes->regs.PC);
     printf("\n");
 }
 
 #define UNCOMPLEMENT(X) ((X) < 128 ? (X) : (X - 256))
 
 struct Instruction * fetchInstruction(int addr, int * arg1, int * arg2){
-    int opcode = memory[addr];
+    int opcode = peekMemory(addr);
     struct Instruction * ins = instructionFromOpcode(opcode);
-    if(ins->size > 1) *arg1 = memory[addr+1];
-    if(ins->size > 2) *arg2 = memory[addr+2];
+    if(ins->size > 1) *arg1 = peekMemory(addr+1);
+    if(ins->size > 2) *arg2 = peekMemory(addr+2);
     return ins;
 }
 
@@ -591,16 +892,16 @@ unsigned char readMemory(int addr){
         return read2002();
     }
     else if(addr == 0x2004){
-        return oam[oamAddr];
+        return nes->oam[nes->oamAddr];
     }
     else if(addr == 0x2007){
-        byte = ppuDataReadBuffer;
-        ppuDataReadBuffer = ppuMemory[ppuAddr];
+        byte = nes->ppuDataReadBuffer;
+        nes->ppuDataReadBuffer = ppuRead(nes->ppuAddr);
 
-        if(ppuCtrl.vramAddressIncrement)
-            ppuAddr = (ppuAddr + 32) & VRAM_MAX;
+        if(nes->ppuCtrl.vramAddressIncrement)
+            nes->ppuAddr = (nes->ppuAddr + 32) & VRAM_MAX;
         else
-            ppuAddr = (ppuAddr + 1) & VRAM_MAX;
+            nes->ppuAddr = (nes->ppuAddr + 1) & VRAM_MAX;
         return byte;
     }
     else if(addr >= 0x4000 && addr <= 0x4014){
@@ -613,19 +914,24 @@ unsigned char readMemory(int addr){
         return 0;
     }
     else if(addr == 0x4016){
-        byte = gamepadShiftRegister1 & 1;
-        gamepadShiftRegister1 >>= 1;
+        byte = nes->gamepadShiftRegister1 & 1;
+        nes->gamepadShiftRegister1 >>= 1;
         return byte;
     }
     else if(addr == 0x4017){
-        byte = gamepadShiftRegister2 & 1;
-        gamepadShiftRegister2 >>= 1;
+        byte = nes->gamepadShiftRegister2 & 1;
+        nes->gamepadShiftRegister2 >>= 1;
         return byte;
     }
     else if(addr >= 0x4018 && addr <= 0x401f){
         return 0;
     }
-    else return memory[addr];
+    else return peekMemory(addr);
+}
+
+// the DMC channel reads its samples from $8000-$ffff on its own
+unsigned char dmcFetch(int addr){
+    return peekMemory(addr);
 }
 
 void writeMemory(int addr, unsigned char byte){
@@ -636,137 +942,95 @@ void writeMemory(int addr, unsigned char byte){
         write2001(byte);
     }
     else if(addr == 0x2003){
-        oamAddr = byte;
+        nes->oamAddr = byte;
     }
     else if(addr == 0x2004){
-        oam[oamAddr] = byte;
-        oamAddr = (oamAddr + 1) & 0xff;
+        nes->oam[nes->oamAddr] = byte;
+        markDirty(&nes->oam[nes->oamAddr], 1);
+        nes->oamAddr = (nes->oamAddr + 1) & 0xff;
     }
     else if(addr == 0x2005){
-        if(ppuW == 0){
-            ppuScrollX = byte;
-            ppuFineX = byte & 7;
-            ppuW = !ppuW;
+        if(nes->ppuW == 0){
+            nes->ppuScrollX = byte;
+            nes->ppuFineX = byte & 7;
+            nes->ppuW = !nes->ppuW;
         }
-        else if(ppuW == 1){
-            ppuScrollY = byte;
-            ppuW = !ppuW;
+        else if(nes->ppuW == 1){
+            nes->ppuScrollY = byte;
+            nes->ppuW = !nes->ppuW;
         }
     }
     else if(addr == 0x2006){
-        if(ppuW == 0){
-            ppuAddr = (int)byte << 8;
-            ppuW = !ppuW;
+        if(nes->ppuW == 0){
+            nes->ppuAddr = (int)byte << 8;
+            nes->ppuW = !nes->ppuW;
 
             // internally, first write to this address clobbers the nametable base
-            ppuCtrl.nametableBase = (byte >> 2) & 3;
+            nes->ppuCtrl.nametableBase = (byte >> 2) & 3;
         }
-        else if(ppuW == 1){
-            ppuAddr |= byte;
-            ppuW = !ppuW;
+        else if(nes->ppuW == 1){
+            nes->ppuAddr |= byte;
+            nes->ppuW = !nes->ppuW;
         }
     }
     else if(addr == 0x2007){
-        if(ppuAddr < 0x2000){
-            printf("PC=%04x WUT attempting to write to CHR ROM.\n", regs.PC);
-            debug();
-            printf("ppuAddr = %04x\n", ppuAddr);
-            printf("data = %02x\n", byte);
-            exit(1);
-        }
-        else if(ppuAddr < 0 || ppuAddr > 0x3fff){
+        if(nes->ppuAddr < 0 || nes->ppuAddr > 0x3fff){
             printf("PPUDATA write out of range\n");
             exit(1);
         }
         else{
-            if(ppuAddr >= 0x2800 && ppuAddr <= 0x2fff){
-                printf("fixme, they tried to use mirroring (%04x)\n", ppuAddr);
-                exit(1);
-            }
-
-            // this piece of palette memory is mirrored.
-            if(ppuAddr == 0x3f10){
-                ppuMemory[0x3f00] = byte;
-            }
-            else{
-                ppuMemory[ppuAddr] = byte;
-            }
+            ppuWrite(nes->ppuAddr, byte);
 
-            if(ppuCtrl.vramAddressIncrement)
-                ppuAddr = (ppuAddr + 32) & VRAM_MAX;
+            if(nes->ppuCtrl.vramAddressIncrement)
+                nes->ppuAddr = (nes->ppuAddr + 32) & VRAM_MAX;
             else
-                ppuAddr = (ppuAddr + 1) & VRAM_MAX;
+                nes->ppuAddr = (nes->ppuAddr + 1) & VRAM_MAX;
         }
     }
     else if(addr == 0x4014){
-        int ptr = oamAddr;
+        int ptr = nes->oamAddr;
         for(int i = 0; i < 256; i++){
-            oam[ptr] = memory[0x200 + i];
+            nes->oam[ptr] = nes->ram[0x200 + i];
             if(++ptr > 255) ptr = 0;
         }
+        markDirty(nes->oam, sizeof nes->oam);
 
-        dmaFlag = 1;
+        nes->dmaFlag = 1;
     }
     // write to sound chip controls
-    else if(addr == 0x4000){
-        setEnvelope(0, byte & 0x3f);
-        setDutyCycle(0, byte >> 6);
-    }
-    else if(addr == 0x4001){
-        setSweep(0, byte);
-    }
-    else if(addr == 0x4002){
-        setTimerLow(0, byte);
-    }
-    else if(addr == 0x4003){
-        setTimerHigh(0, byte & 7);
-        setLengthCounter(0, byte >> 3);
-    }
-    else if(addr == 0x4004){
-        setEnvelope(1, byte & 0x3f);
-        setDutyCycle(1, byte >> 6);
-    }
-    else if(addr == 0x4005){
-        setSweep(1, byte);
-    }
-    else if(addr == 0x4006){
-        setTimerLow(1, byte);
-    }
-    else if(addr == 0x4007){
-        setTimerHigh(1, byte & 7);
-        setLengthCounter(1, byte >> 3);
-    }
-    else if(addr == 0x4015){
-        setEnable(0, byte & 1);
-        setEnable(1, (byte >> 1) & 1);
+    else if(addr >= 0x4000 && addr <= 0x4015){
+        apuWrite(addr, byte);
     }
     else if(addr == 0x4016){
-        gamepadShiftRegister1 = packGamepad(&gamepad1);
-        gamepadShiftRegister2 = packGamepad(&gamepad2);
+        unsigned char pad1 = packGamepad(&console->gamepad1);
+        unsigned char pad2 = packGamepad(&console->gamepad2);
+        if(console->movie && console->speculative) movieInput(console->movie, nes->frameNo, &pad1, &pad2);
+        else if(console->movie) movieLatch(console->movie, nes->frameNo, &pad1, &pad2);
+        nes->gamepadShiftRegister1 = pad1;
+        nes->gamepadShiftRegister2 = pad2;
     }
     else if(addr == 0x4017){
-        setFrameCounterPeriod(byte >> 7);
+        apuWrite(addr, byte);
     }
     else if(addr >= 0x4018 && addr <= 0x401f){
     }
-    else if(addr >= 0x4020){
-        printf("attempting to write to unmapped memory ($%04x <= $%02x)\n", addr, byte);
-        exit(1);
-    }
-    else if(addr >= 0x6000){
-        printf("attempting to write to cart RAM (not there) ($%04x <= $%02x)\n", addr, byte);
+    else if(addr < 0 || addr > 0xffff){
+        printf("attempting to write out of bounds ($%04x <= $%02x)\n", addr, byte);
         exit(1);
     }
     else if(addr >= 0x8000){
-        printf("attempting to write to PRG ROM ($%04x <= $%02x)\n", addr, byte);
-        exit(1);
+        cartMapper->write(addr, byte);
     }
-    else if(addr < 0 || addr > 0xffff){
-        printf("attempting to write out of bounds ($%04x <= $%02x)\n", addr, byte);
+    else if(addr >= 0x6000){
+        nes->prgRam[addr & 0x1fff] = byte;
+        markDirty(&nes->prgRam[addr & 0x1fff], 1);
+    }
+    else if(addr >= 0x4020){
+        printf("attempting to write to unmapped memory ($%04x <= $%02x)\n", addr, byte);
         exit(1);
     }
-    else {
-        memory[addr] = byte;
+    else if(addr < 0x2000){
+        storeRam(addr & 0x7ff, byte);
         logWrite(addr);
     }
 }
@@ -789,27 +1053,31 @@ unsigned char sbc(unsigned char a, unsigned char b, int carry, struct ProcessorS
 int nextCPUDelay(){
     // this could easily be a table
     int arg1, arg2;
-    struct Instruction * ins = fetchInstruction(regs.PC, &arg1, &arg2);
+    struct Instruction * ins = fetchInstruction(nes->regs.PC, &arg1, &arg2);
     return ins->cycles;
 }
 
-// 7 cycle interrupt sequence, transfer control to NMI vector
+// 7 cycle interrupt sequence, transfer control to the vector at addr
+void interruptCPU(int addr){
+    storeRam(0x0100 + nes->regs.S, nes->regs.PC >> 8);
+    nes->regs.S--;
+    storeRam(0x0100 + nes->regs.S, nes->regs.PC & 0xff);
+    nes->regs.S--;
+    storeRam(0x0100 + nes->regs.S, packProcessorStatus(nes->regs.P));
+    nes->regs.S--;
+    nes->regs.P.interruptDisable = 1;
+    nes->regs.PC = vectorAt(addr);
+}
+
 void nmiCPU(){
-    memory[0x0100 + regs.S] = regs.PC >> 8;
-    regs.S--;
-    memory[0x0100 + regs.S] = regs.PC & 0xff;
-    regs.S--;
-    memory[0x0100 + regs.S] = packProcessorStatus(regs.P);
-    regs.S--;
-    regs.P.interruptDisable = 1;
-    regs.PC = vectors.nmi;
+    interruptCPU(0xfffa);
 }
 
 // fetch next instruction and execute effects
 // leaves the CPU in some state after N cycles (see nextCPUDelay)
 void stepCPU(){
     int arg1, arg2;
-    struct Instruction * ins = fetchInstruction(regs.PC, &arg1, &arg2);
+    struct Instruction * ins = fetchInstruction(nes->regs.PC, &arg1, &arg2);
     int size = ins->size;
     int arg21;
     int addr;
@@ -819,773 +1087,773 @@ void stepCPU(){
     int lower;
     int upper;
 
-    remember(regs.PC);
-    regs.PC += size;
+    remember(nes->regs.PC);
+    nes->regs.PC += size;
 
     switch(ins->opcode){
         case 0x78: // SEI
-            regs.P.interruptDisable = 1;
+            nes->regs.P.interruptDisable = 1;
             break;
 
         case 0x38: // SEC
-            regs.P.carry = 1;
+            nes->regs.P.carry = 1;
             break;
 
         case 0xd8: // CLD
-            regs.P.decimal = 0;
+            nes->regs.P.decimal = 0;
             break;
 
         case 0x18: // CLC
-            regs.P.carry = 0;
+            nes->regs.P.carry = 0;
             break;
 
         case 0xc9: // CMP #$43
-            regs.P.carry     = regs.A >= arg1;
-            regs.P.zero      = regs.A == arg1;
-            c = regs.A - arg1;
-            regs.P.negative  = c >> 7;
+            nes->regs.P.carry     = nes->regs.A >= arg1;
+            nes->regs.P.zero      = nes->regs.A == arg1;
+            c = nes->regs.A - arg1;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xc5: // CMP $03
-            m = memory[arg1];
-            regs.P.carry     = regs.A >= m;
-            regs.P.zero      = regs.A == m;
-            c = regs.A - m;
-            regs.P.negative  = c >> 7;
+            m = nes->ram[arg1];
+            nes->regs.P.carry     = nes->regs.A >= m;
+            nes->regs.P.zero      = nes->regs.A == m;
+            c = nes->regs.A - m;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xd5: // CMP $03, X
-            addr = (arg1 + regs.X) & 0xff;
-            m = memory[addr];
-            regs.P.carry     = regs.A >= m;
-            regs.P.zero      = regs.A == m;
-            c = regs.A - m;
-            regs.P.negative  = c >> 7;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            m = nes->ram[addr];
+            nes->regs.P.carry     = nes->regs.A >= m;
+            nes->regs.P.zero      = nes->regs.A == m;
+            c = nes->regs.A - m;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xcd: // CMP $0201
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.P.carry     = regs.A >= m;
-            regs.P.zero      = regs.A == m;
-            c = regs.A - m;
-            regs.P.negative  = c >> 7;
+            nes->regs.P.carry     = nes->regs.A >= m;
+            nes->regs.P.zero      = nes->regs.A == m;
+            c = nes->regs.A - m;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xdd: // CMP $0201, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
-            regs.P.carry     = regs.A >= m;
-            regs.P.zero      = regs.A == m;
-            c = regs.A - m;
-            regs.P.negative  = c >> 7;
+            nes->regs.P.carry     = nes->regs.A >= m;
+            nes->regs.P.zero      = nes->regs.A == m;
+            c = nes->regs.A - m;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xd9: // CMP $0201, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
+            addr = (arg21 + nes->regs.Y) & 0xffff;
             m = readMemory(addr);
-            regs.P.carry     = regs.A >= m;
-            regs.P.zero      = regs.A == m;
-            c = regs.A - m;
-            regs.P.negative  = c >> 7;
+            nes->regs.P.carry     = nes->regs.A >= m;
+            nes->regs.P.zero      = nes->regs.A == m;
+            c = nes->regs.A - m;
+            nes->regs.P.negative  = c >> 7;
             break;
 
 
         case 0xe0: // CPX #$07
-            regs.P.carry     = regs.X >= arg1;
-            regs.P.zero      = regs.X == arg1;
-            c = regs.X - arg1;
-            regs.P.negative  = c >> 7;
+            nes->regs.P.carry     = nes->regs.X >= arg1;
+            nes->regs.P.zero      = nes->regs.X == arg1;
+            c = nes->regs.X - arg1;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xe4: // CPX $06
-            m = memory[arg1];
-            regs.P.carry     = regs.X >= m;
-            regs.P.zero      = regs.X == m;
-            c = regs.X - m;
-            regs.P.negative  = c >> 7;
+            m = nes->ram[arg1];
+            nes->regs.P.carry     = nes->regs.X >= m;
+            nes->regs.P.zero      = nes->regs.X == m;
+            c = nes->regs.X - m;
+            nes->regs.P.negative  = c >> 7;
             break;
             
 
         case 0xc0: // CPY #$07
-            regs.P.carry     = regs.Y >= arg1;
-            regs.P.zero      = regs.Y == arg1;
-            c = regs.Y - arg1;
-            regs.P.negative  = c >> 7;
+            nes->regs.P.carry     = nes->regs.Y >= arg1;
+            nes->regs.P.zero      = nes->regs.Y == arg1;
+            c = nes->regs.Y - arg1;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xc4: // CPY $07
-            m = memory[arg1];
-            regs.P.carry     = regs.Y >= m;
-            regs.P.zero      = regs.Y == m;
-            c = regs.Y - m;
-            regs.P.negative  = c >> 7;
+            m = nes->ram[arg1];
+            nes->regs.P.carry     = nes->regs.Y >= m;
+            nes->regs.P.zero      = nes->regs.Y == m;
+            c = nes->regs.Y - m;
+            nes->regs.P.negative  = c >> 7;
             break;
 
         case 0xcc: // CPY $0201
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.P.carry     = regs.Y >= m;
-            regs.P.zero      = regs.Y == m;
-            c = regs.Y - m;
-            regs.P.negative  = c >> 7;
+            nes->regs.P.carry     = nes->regs.Y >= m;
+            nes->regs.P.zero      = nes->regs.Y == m;
+            c = nes->regs.Y - m;
+            nes->regs.P.negative  = c >> 7;
             break;
             
         case 0xa9: // LDA #$7f
-            regs.A = arg1;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = arg1;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0xa5: // LDA $25
-            regs.A = memory[arg1];
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->ram[arg1];
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0xad: // LDA $0205
             addr = (arg2 << 8) | arg1;
-            regs.A = readMemory(addr);
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0xb5: // LDA $23, X
-            addr = (arg1 + regs.X) & 0xff;
-            regs.A = memory[addr];
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            nes->regs.A = nes->ram[addr];
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0xbd: // LDA $0205, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
-            regs.A = readMemory(addr);
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            addr = (arg21 + nes->regs.X) & 0xffff;
+            nes->regs.A = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0xb1: // LDA ($00), Y
-            lower = memory[arg1];
-            upper = memory[(arg1+1) & 0xff];
+            lower = nes->ram[arg1];
+            upper = nes->ram[(arg1+1) & 0xff];
             addr = (upper << 8) | lower;
-            addr += regs.Y;
+            addr += nes->regs.Y;
             addr &= 0xffff;
-            regs.A = readMemory(addr);
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0xb9: // LDA $0233, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
-            regs.A = readMemory(addr);
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            addr = (arg21 + nes->regs.Y) & 0xffff;
+            nes->regs.A = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x85: // STA $06
-            memory[arg1] = regs.A;
+            storeRam(arg1, nes->regs.A);
             logWrite(arg1);
             break;
 
         case 0x95: // STA $06, X
-            addr = (arg1 + regs.X) & 0xff;
-            memory[addr] = regs.A;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            storeRam(addr, nes->regs.A);
             logWrite(addr);
             break;
 
         case 0x8d: // STA $0205
             arg21 = (arg2 << 8) | arg1;
-            writeMemory(arg21, regs.A);
+            writeMemory(arg21, nes->regs.A);
             break;
 
         case 0x91: // STA ($06), Y
-            lower = memory[arg1];
-            upper = memory[(arg1 + 1) & 0xff];
+            lower = nes->ram[arg1];
+            upper = nes->ram[(arg1 + 1) & 0xff];
             addr = (upper << 8) | lower;
-            addr += regs.Y;
+            addr += nes->regs.Y;
             addr &= 0xffff;
-            writeMemory(addr, regs.A);
+            writeMemory(addr, nes->regs.A);
             break;
 
         case 0x99: // STA $0205, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
-            writeMemory(addr, regs.A);
+            addr = (arg21 + nes->regs.Y) & 0xffff;
+            writeMemory(addr, nes->regs.A);
             break;
 
         case 0x9d: // STA $0205, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
-            writeMemory(addr, regs.A);
+            addr = (arg21 + nes->regs.X) & 0xffff;
+            writeMemory(addr, nes->regs.A);
             break;
 
         case 0xa2: // LDX #$7f
-            regs.X = arg1;
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            nes->regs.X = arg1;
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0xa6: // LDX $07
-            regs.X = memory[arg1];
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            nes->regs.X = nes->ram[arg1];
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0xb6: // LDX $07, Y
-            addr = (arg1 + regs.Y) & 0xff;
-            regs.X = memory[addr];
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            addr = (arg1 + nes->regs.Y) & 0xff;
+            nes->regs.X = nes->ram[addr];
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0xae: // LDX $0203
             addr = (arg2 << 8) | arg1;
-            regs.X = readMemory(addr);
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            nes->regs.X = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0xbe: // LDX $0203, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
-            regs.X = readMemory(addr);
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            addr = (arg21 + nes->regs.Y) & 0xffff;
+            nes->regs.X = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0xa0: // LDY #$7f
-            regs.Y = arg1;
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            nes->regs.Y = arg1;
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0xa4: // LDY $07
-            regs.Y = memory[arg1];
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            nes->regs.Y = nes->ram[arg1];
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0xb4: // LDY $07, X
-            addr = (arg1 + regs.X) & 0xff;
-            regs.Y = memory[addr];
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            nes->regs.Y = nes->ram[addr];
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0xac: // LDY $0203
             addr = (arg2 << 8) | arg1;
-            regs.Y = readMemory(addr);
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            nes->regs.Y = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0xbc: // LDY $0203, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
-            regs.Y = readMemory(addr);
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            addr = (arg21 + nes->regs.X) & 0xffff;
+            nes->regs.Y = readMemory(addr);
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0x86: // STX $07
-            memory[arg1] = regs.X;
+            storeRam(arg1, nes->regs.X);
             logWrite(arg1);
             break;
 
         case 0x8e: // STX $0201
             addr = (arg2 << 8) | arg1;
-            writeMemory(addr, regs.X);
+            writeMemory(addr, nes->regs.X);
             break;
 
         case 0x84: // STY $07
-            memory[arg1] = regs.Y;
+            storeRam(arg1, nes->regs.Y);
             logWrite(arg1);
             break;
 
         case 0x94: // STY $07, X
-            addr = (arg1 + regs.X) & 0xff;
-            memory[addr] = regs.Y;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            storeRam(addr, nes->regs.Y);
             logWrite(addr);
             break;
 
         case 0x8c: // STY $0201
             addr = (arg2 << 8) | arg1;
-            writeMemory(addr, regs.Y);
+            writeMemory(addr, nes->regs.Y);
             break;
 
         case 0x9a: // TXS
-            regs.S = regs.X;
+            nes->regs.S = nes->regs.X;
             break;
 
         case 0x8a: // TXA
-            regs.A = regs.X;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.X;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x98: // TYA
-            regs.A = regs.Y;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.Y;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0xaa: // TAX
-            regs.X = regs.A;
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            nes->regs.X = nes->regs.A;
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0xa8: // TAY
-            regs.Y = regs.A;
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            nes->regs.Y = nes->regs.A;
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0x48: // PHA
-            memory[0x0100 + regs.S] = regs.A;
-            logWrite(0x0100 + regs.S);
-            regs.S--;
+            storeRam(0x0100 + nes->regs.S, nes->regs.A);
+            logWrite(0x0100 + nes->regs.S);
+            nes->regs.S--;
             break;
 
         case 0x68: // PLA
-            regs.S++;
-            regs.A = memory[0x0100 + regs.S];
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.S++;
+            nes->regs.A = nes->ram[0x0100 + nes->regs.S];
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x10: // BPL #7 branch if positive (i.e. not negative)
-            if(regs.P.negative == 0) regs.PC += UNCOMPLEMENT(arg1);
+            if(nes->regs.P.negative == 0) nes->regs.PC += UNCOMPLEMENT(arg1);
             break;
 
         case 0x30: // BMI #6 branch if minus
-            if(regs.P.negative) regs.PC += UNCOMPLEMENT(arg1);
+            if(nes->regs.P.negative) nes->regs.PC += UNCOMPLEMENT(arg1);
             break;
 
         case 0xb0: // BCS #3 branch if carry
-            if(regs.P.carry) regs.PC += UNCOMPLEMENT(arg1);
+            if(nes->regs.P.carry) nes->regs.PC += UNCOMPLEMENT(arg1);
             break;
 
         case 0x90: // BCC #3 branch if carry clear
-            if(regs.P.carry == 0) regs.PC += UNCOMPLEMENT(arg1);
+            if(nes->regs.P.carry == 0) nes->regs.PC += UNCOMPLEMENT(arg1);
             break;
 
         case 0xd0: // BNE #4 branch if not equal
-            if(regs.P.zero == 0) regs.PC += UNCOMPLEMENT(arg1);
+            if(nes->regs.P.zero == 0) nes->regs.PC += UNCOMPLEMENT(arg1);
             break;
 
         case 0xf0: // BEQ #6 branch if equal
-            if(regs.P.zero) regs.PC += UNCOMPLEMENT(arg1);
+            if(nes->regs.P.zero) nes->regs.PC += UNCOMPLEMENT(arg1);
             break;
 
         case 0x0a: // ASL (shift left, introducing zeros)
-            regs.P.carry = regs.A >> 7;
-            regs.A = regs.A << 1;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.P.carry = nes->regs.A >> 7;
+            nes->regs.A = nes->regs.A << 1;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x0e: // ASL, $0201
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.P.carry = m >> 7;
+            nes->regs.P.carry = m >> 7;
             c = m << 1;
             writeMemory(addr, c);
-            regs.P.zero =     c == 0;
-            regs.P.negative = c >> 7;
+            nes->regs.P.zero =     c == 0;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0x4a: // LSR A (shift right, introducing zeros)
-            regs.P.carry = regs.A & 1;
-            regs.A = regs.A >> 1;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.P.carry = nes->regs.A & 1;
+            nes->regs.A = nes->regs.A >> 1;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x46: // LSR $15
-            m = memory[arg1];
-            regs.P.carry = m & 1;
+            m = nes->ram[arg1];
+            nes->regs.P.carry = m & 1;
             c = m >> 1;
-            memory[arg1] = c;
-            regs.P.zero     = c == 0;
-            regs.P.negative = c >> 7;
+            storeRam(arg1, c);
+            nes->regs.P.zero     = c == 0;
+            nes->regs.P.negative = c >> 7;
             logWrite(arg1);
             break;
 
         case 0x4e: // LSR $0201
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.P.carry = m & 1;
+            nes->regs.P.carry = m & 1;
             c = m >> 1;
-            regs.P.zero     = c == 0;
-            regs.P.negative = c >> 7;
+            nes->regs.P.zero     = c == 0;
+            nes->regs.P.negative = c >> 7;
             writeMemory(addr, c);
             break;
 
         case 0x2a: // ROL A   rotate left
-            if(regs.P.carry > 1){
+            if(nes->regs.P.carry > 1){
                 printf("botched carry bit\n");
                 exit(1);
             }
-            bit = regs.P.carry;
-            regs.P.carry = regs.A >> 7;
-            regs.A = (regs.A << 1) | bit;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            bit = nes->regs.P.carry;
+            nes->regs.P.carry = nes->regs.A >> 7;
+            nes->regs.A = (nes->regs.A << 1) | bit;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x26: // ROL $14
-            bit = regs.P.carry;
-            m = memory[arg1];
-            regs.P.carry = m >> 7;
+            bit = nes->regs.P.carry;
+            m = nes->ram[arg1];
+            nes->regs.P.carry = m >> 7;
             c = (m << 1) | bit;
-            regs.P.zero     = c == 0;
-            regs.P.negative = c >> 7;
-            memory[arg1] = c;
+            nes->regs.P.zero     = c == 0;
+            nes->regs.P.negative = c >> 7;
+            storeRam(arg1, c);
             logWrite(arg1);
             break;
 
         case 0x2e: // ROL $0201
             addr = (arg2 << 8) | arg1;
-            bit = regs.P.carry;
+            bit = nes->regs.P.carry;
             m = readMemory(addr);
-            regs.P.carry = m >> 7;
+            nes->regs.P.carry = m >> 7;
             c = (m << 1) | bit;
-            regs.P.zero     = c == 0;
-            regs.P.negative = c >> 7;
+            nes->regs.P.zero     = c == 0;
+            nes->regs.P.negative = c >> 7;
             writeMemory(addr, c);
             break;
 
         case 0x6a: // ROR A   rotate right
-            bit = regs.P.carry;
-            regs.P.carry = regs.A & 1;
-            regs.A = (regs.A >> 1) | (bit << 7);
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            bit = nes->regs.P.carry;
+            nes->regs.P.carry = nes->regs.A & 1;
+            nes->regs.A = (nes->regs.A >> 1) | (bit << 7);
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x7e: // ROR $0201, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
-            bit = regs.P.carry;
-            regs.P.carry = m & 1;
+            bit = nes->regs.P.carry;
+            nes->regs.P.carry = m & 1;
             m = (m >> 1) | (bit << 7);
-            regs.P.zero     = m == 0;
-            regs.P.negative = m >> 7;
+            nes->regs.P.zero     = m == 0;
+            nes->regs.P.negative = m >> 7;
             writeMemory(addr, m);
             break;
 
         case 0x09: // ORA #$1f
-            regs.A = regs.A | arg1;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A | arg1;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x05: // ORA $1f
-            regs.A = regs.A | memory[arg1];
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A | nes->ram[arg1];
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x15: // ORA $1f, X
-            addr = (arg1 + regs.X) & 0xff;
-            regs.A = regs.A | memory[addr];
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            nes->regs.A = nes->regs.A | nes->ram[addr];
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x0d: // ORA $0203
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.A = regs.A | m;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A | m;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x1d: // ORA $0203, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
-            regs.A = regs.A | m;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A | m;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x19: // ORA $0203, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
+            addr = (arg21 + nes->regs.Y) & 0xffff;
             m = readMemory(addr);
-            regs.A = regs.A | m;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A | m;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x29: // AND #$1f
-            regs.A = regs.A & arg1;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A & arg1;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x25: // AND $02
-            regs.A = regs.A & memory[arg1];
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A & nes->ram[arg1];
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x2d: // AND $0201
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.A = regs.A & m;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A & m;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x3d: // AND $0201, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
-            regs.A = regs.A & m;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A & m;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x39: // AND $0201, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
+            addr = (arg21 + nes->regs.Y) & 0xffff;
             m = readMemory(addr);
-            regs.A = regs.A & m;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A & m;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x49: // EOR #$11
-            regs.A = regs.A ^ arg1;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            nes->regs.A = nes->regs.A ^ arg1;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
         case 0x45: // EOR $11
-            m = memory[arg1];
-            regs.A = regs.A ^ m;
-            regs.P.zero     = regs.A == 0;
-            regs.P.negative = regs.A >> 7;
+            m = nes->ram[arg1];
+            nes->regs.A = nes->regs.A ^ m;
+            nes->regs.P.zero     = nes->regs.A == 0;
+            nes->regs.P.negative = nes->regs.A >> 7;
             break;
 
 
         // In ADC and SBC handler, status bits are handled by the subroutine
         case 0x69: // ADC #$7
-            regs.A = adc(regs.A, arg1, regs.P.carry, &regs.P);
+            nes->regs.A = adc(nes->regs.A, arg1, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0x65: // ADC $3c
-            m = memory[arg1];
-            regs.A = adc(regs.A, m, regs.P.carry, &regs.P);
+            m = nes->ram[arg1];
+            nes->regs.A = adc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0x75: // ADC $3c, X
-            addr = (arg1 + regs.X) & 0xff;
-            m = memory[addr];
-            regs.A = adc(regs.A, m, regs.P.carry, &regs.P);
+            addr = (arg1 + nes->regs.X) & 0xff;
+            m = nes->ram[addr];
+            nes->regs.A = adc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0x6d: // ADC $0201
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.A = adc(regs.A, m, regs.P.carry, &regs.P);
+            nes->regs.A = adc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0x7d: // ADC $0201, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
-            regs.A = adc(regs.A, m, regs.P.carry, &regs.P);
+            nes->regs.A = adc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0x79: // ADC $0201, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
+            addr = (arg21 + nes->regs.Y) & 0xffff;
             m = readMemory(addr);
-            regs.A = adc(regs.A, m, regs.P.carry, &regs.P);
+            nes->regs.A = adc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0xe9: // SBC #$5
-            regs.A = sbc(regs.A, arg1, regs.P.carry, &regs.P);
+            nes->regs.A = sbc(nes->regs.A, arg1, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0xe5: // SBC $52
-            m = memory[arg1];
-            regs.A = sbc(regs.A, m, regs.P.carry, &regs.P);
+            m = nes->ram[arg1];
+            nes->regs.A = sbc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0xf5: // SBC $1f, X
-            addr = (arg1 + regs.X) & 0xff;
-            m = memory[addr];
-            regs.A = sbc(regs.A, m, regs.P.carry, &regs.P);
+            addr = (arg1 + nes->regs.X) & 0xff;
+            m = nes->ram[addr];
+            nes->regs.A = sbc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0xed: // SBC $0201
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.A = sbc(regs.A, m, regs.P.carry, &regs.P);
+            nes->regs.A = sbc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0xfd: // SBC $0201, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
-            regs.A = sbc(regs.A, m, regs.P.carry, &regs.P);
+            nes->regs.A = sbc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0xf9: // SBC $0201, Y
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.Y) & 0xffff;
+            addr = (arg21 + nes->regs.Y) & 0xffff;
             m = readMemory(addr);
-            regs.A = sbc(regs.A, m, regs.P.carry, &regs.P);
+            nes->regs.A = sbc(nes->regs.A, m, nes->regs.P.carry, &nes->regs.P);
             break;
 
         case 0x24: // BIT $44
-            m = memory[arg1];
-            regs.P.overflow = (m >> 6) & 1;
-            regs.P.negative = (m >> 7) & 1;
-            regs.P.zero = (m & regs.A) == 0;
+            m = nes->ram[arg1];
+            nes->regs.P.overflow = (m >> 6) & 1;
+            nes->regs.P.negative = (m >> 7) & 1;
+            nes->regs.P.zero = (m & nes->regs.A) == 0;
             break;
 
         case 0x2c: // BIT $0203
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
-            regs.P.overflow = (m >> 6) & 1;
-            regs.P.negative = (m >> 7) & 1;
-            regs.P.zero = (m & regs.A) == 0;
+            nes->regs.P.overflow = (m >> 6) & 1;
+            nes->regs.P.negative = (m >> 7) & 1;
+            nes->regs.P.zero = (m & nes->regs.A) == 0;
             break;
             
         case 0xca: // DEX
-            regs.X--;
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            nes->regs.X--;
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0x88: // DEY
-            regs.Y--;
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            nes->regs.Y--;
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0xe6: // INC $11
-            m = memory[arg1];
-            memory[arg1] = m + 1;
+            m = nes->ram[arg1];
+            storeRam(arg1, m + 1);
             logWrite(arg1);
-            regs.P.zero     = (m + 1) == 0;
+            nes->regs.P.zero     = (m + 1) == 0;
             c = m + 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xf6: // INC $11, X
-            addr = (arg1 + regs.X) & 0xff;
-            m = memory[addr];
-            memory[addr] = m + 1;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            m = nes->ram[addr];
+            storeRam(addr, m + 1);
             logWrite(addr);
-            regs.P.zero     = (m + 1) == 0;
+            nes->regs.P.zero     = (m + 1) == 0;
             c = m + 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xee: // INC $0203   increment memory
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
             writeMemory(addr, m + 1);
-            regs.P.zero     = (m + 1) == 0;
+            nes->regs.P.zero     = (m + 1) == 0;
             c = m + 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xfe: // INC $0203, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
             writeMemory(addr, m + 1);
-            regs.P.zero     = (m + 1) == 0;
+            nes->regs.P.zero     = (m + 1) == 0;
             c = m + 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xce: // DEC $0203
             addr = (arg2 << 8) | arg1;
             m = readMemory(addr);
             writeMemory(addr, m - 1);
-            regs.P.zero     = (m - 1) == 0;
+            nes->regs.P.zero     = (m - 1) == 0;
             c = m - 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xc6: // DEC $03
-            m = memory[arg1];
-            memory[arg1] = m - 1;
+            m = nes->ram[arg1];
+            storeRam(arg1, m - 1);
             logWrite(arg1);
-            regs.P.zero     = (m - 1) == 0;
+            nes->regs.P.zero     = (m - 1) == 0;
             c = m - 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xd6: // DEC $11, X
-            addr = (arg1 + regs.X) & 0xff;
-            m = memory[addr];
-            memory[addr] = m - 1;
+            addr = (arg1 + nes->regs.X) & 0xff;
+            m = nes->ram[addr];
+            storeRam(addr, m - 1);
             logWrite(addr);
-            regs.P.zero     = (m - 1) == 0;
+            nes->regs.P.zero     = (m - 1) == 0;
             c = m - 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xde: // DEC $0203, X
             arg21 = (arg2 << 8) | arg1;
-            addr = (arg21 + regs.X) & 0xffff;
+            addr = (arg21 + nes->regs.X) & 0xffff;
             m = readMemory(addr);
             writeMemory(addr, m - 1);
-            regs.P.zero     = (m - 1) == 0;
+            nes->regs.P.zero     = (m - 1) == 0;
             c = m - 1;
-            regs.P.negative = c >> 7;
+            nes->regs.P.negative = c >> 7;
             break;
 
         case 0xe8: // INX
-            regs.X++;
-            regs.P.zero     = regs.X == 0;
-            regs.P.negative = regs.X >> 7;
+            nes->regs.X++;
+            nes->regs.P.zero     = nes->regs.X == 0;
+            nes->regs.P.negative = nes->regs.X >> 7;
             break;
 
         case 0xc8: // INY
-            regs.Y++;
-            regs.P.zero     = regs.Y == 0;
-            regs.P.negative = regs.Y >> 7;
+            nes->regs.Y++;
+            nes->regs.P.zero     = nes->regs.Y == 0;
+            nes->regs.P.negative = nes->regs.Y >> 7;
             break;
 
         case 0x20: // JSR $8100
             arg21 = (arg2 << 8) | arg1;
-            addr = regs.PC - 1;
-            memory[0x0100 + regs.S] = addr >> 8;
-            logWrite(0x0100 + regs.S);
-            regs.S--;
-            memory[0x0100 + regs.S] = addr & 0xff;
-            logWrite(0x0100 + regs.S);
-            regs.S--;
-            regs.PC = arg21;
+            addr = nes->regs.PC - 1;
+            storeRam(0x0100 + nes->regs.S, addr >> 8);
+            logWrite(0x0100 + nes->regs.S);
+            nes->regs.S--;
+            storeRam(0x0100 + nes->regs.S, addr & 0xff);
+            logWrite(0x0100 + nes->regs.S);
+            nes->regs.S--;
+            nes->regs.PC = arg21;
             break;
 
         case 0x60: // RTS
-            regs.S++;
-            regs.PC = memory[0x0100 + regs.S];
-            regs.S++;
-            regs.PC |= memory[0x0100 + regs.S] << 8;
-            regs.PC++;
+            nes->regs.S++;
+            nes->regs.PC = nes->ram[0x0100 + nes->regs.S];
+            nes->regs.S++;
+            nes->regs.PC |= nes->ram[0x0100 + nes->regs.S] << 8;
+            nes->regs.PC++;
             break;
 
         case 0x4c: // JMP $810c
             arg21 = (arg2 << 8) | arg1;
-            regs.PC = arg21;
+            nes->regs.PC = arg21;
             break;
 
         case 0x6c: // JMP ($0123)
@@ -1593,19 +1861,19 @@ void stepCPU(){
             lower = readMemory(arg21);
             upper = readMemory((arg21 + 1) & 0xffff);
             addr = (upper << 8) | lower;
-            regs.PC = addr;
+            nes->regs.PC = addr;
             break;
 
         case 0x40: // RTI
-            regs.S++;
-            m = memory[0x0100 + regs.S];
-            regs.S++;
-            lower = memory[0x0100 + regs.S];
-            regs.S++;
-            upper = memory[0x0100 + regs.S];
+            nes->regs.S++;
+            m = nes->ram[0x0100 + nes->regs.S];
+            nes->regs.S++;
+            lower = nes->ram[0x0100 + nes->regs.S];
+            nes->regs.S++;
+            upper = nes->ram[0x0100 + nes->regs.S];
             addr = (upper << 8) | lower; 
-            regs.P = unpackProcessorStatus(m);
-            regs.PC = addr;
+            nes->regs.P = unpackProcessorStatus(m);
+            nes->regs.PC = addr;
             break;
 
         default:
@@ -1617,67 +1885,433 @@ void stepCPU(){
 
 }
 
-void readRom(){
-    struct NESHeader hdr;
+/* cartridges
+A .nes file is a 16 byte header, maybe a 512 byte trainer, the PRG ROM
+and then the CHR ROM. The header is iNES or NES 2.0, which is iNES with
+the spare bytes put to use (bits 2-3 of byte 7 are 2): bigger mappers
+and rom sizes, and RAM sizes that iNES had to guess.
+
+readRom maps the file and points prgRom and chrRom into it, nothing is
+copied. The mapper pages the banks in from there. A build with
+EMBEDDED_ROM has rom.h (headerize) compiled in to fall back on.
+*/
+struct Cartridge {
+    int nes2; // NES 2.0 header, else iNES
+    int mapper;
+    int submapper;
+    long prgSize;
+    long chrSize; // 0 means the board has CHR RAM
+    long prgRamSize;
+    long prgNvramSize; // battery backed
+    long chrRamSize;
+    int mirroring; // 0 horizontal, 1 vertical, 2 four screen
+    int battery;
+    int trainer;
+    int timing; // 0 NTSC, 1 PAL, 2 either, 3 Dendy
+};
+
+struct Cartridge cart;
+unsigned long long romHash; // of the whole .nes file
+const unsigned char *romFile = NULL; // the mapping, if the rom came from a file
+size_t romFileSize = 0;
+
+// a NES 2.0 rom size: lsb from the old size byte, msb nibble from byte 9.
+// An msb of $f means the lsb is an exponent and multiplier instead. Sizes
+// can be far bigger than a long holds on some hosts, anything that won't
+// fit in 64 bits comes back as the most there is.
+unsigned long long nes2RomSize(int lsb, int msb, unsigned long long unit){
+    if(msb == 0xf){
+        int exponent = lsb >> 2;
+        int multiplier = (lsb & 3) * 2 + 1;
+        if(exponent > 60) return ~0ULL;
+        return (1ULL << exponent) * multiplier;
+    }
+    return ((unsigned long long)msb << 8 | lsb) * unit;
+}
+
+// NES 2.0 RAM sizes are shift counts, 64 << n bytes, 0 = none
+long nes2RamSize(int n){
+    return n ? 64L << n : 0;
+}
+
+// read the header of the size bytes of .nes file at data into c.
+// Returns what's wrong with it, or NULL.
+const char * parseCartridge(const unsigned char *data, size_t size, struct Cartridge *c){
+    memset(c, 0, sizeof *c);
+
+    if(size < 16 || memcmp(data, "NES\x1a", 4) != 0) return "not an iNES file";
+
+    const unsigned char *h = data;
+    c->nes2 = (h[7] & 0x0c) == 0x08;
+    c->trainer = (h[6] >> 2) & 1;
+    c->battery = (h[6] >> 1) & 1;
+    c->mirroring = (h[6] & 0x08) ? 2 : (h[6] & 1);
+    c->mapper = h[6] >> 4;
+
+    // sizes are checked against the file before they go in c
+    unsigned long long prgSize;
+    unsigned long long chrSize;
+
+    if(c->nes2){
+        c->mapper |= (h[7] & 0xf0) | (h[8] & 0x0f) << 8;
+        c->submapper = h[8] >> 4;
+        prgSize = nes2RomSize(h[4], h[9] & 0x0f, 0x4000);
+        chrSize = nes2RomSize(h[5], h[9] >> 4, 0x2000);
+        c->prgRamSize = nes2RamSize(h[10] & 0x0f);
+        c->prgNvramSize = nes2RamSize(h[10] >> 4);
+        c->chrRamSize = nes2RamSize(h[11] & 0x0f) + nes2RamSize(h[11] >> 4);
+        c->timing = h[12] & 3;
+    }
+    else{
+        // old dumps have junk like "DiskDude!" from byte 7 on, then only
+        // the low nibble of the mapper can be believed
+        if(h[12] == 0 && h[13] == 0 && h[14] == 0 && h[15] == 0) c->mapper |= h[7] & 0xf0;
+        prgSize = h[4] * 0x4000ULL;
+        chrSize = h[5] * 0x2000ULL;
+        c->prgRamSize = h[8] ? h[8] * 0x2000L : 0x2000;
+        if(c->battery){
+            c->prgNvramSize = c->prgRamSize;
+            c->prgRamSize = 0;
+        }
+        c->chrRamSize = chrSize ? 0 : 0x2000;
+        c->timing = h[9] & 1;
+    }
+
+    if(prgSize == 0) return "bad rom size in header";
+
+    if(prgSize > size || chrSize > size) return "file is shorter than its header says";
+    unsigned long long need = 16 + (c->trainer ? 512 : 0) + prgSize + chrSize;
+    if(need > size) return "file is shorter than its header says";
+
+    c->prgSize = prgSize;
+    c->chrSize = chrSize;
+
+    return NULL;
+}
+
+/* mappers
+The board in the cartridge decides which banks of its rom the cpu and
+ppu see. The cpu sees PRG ROM at $8000 - $ffff through prgPage, four 8K
+pages. The ppu sees CHR ROM or RAM at $0000 - $1fff and the nametables
+at $2000 - $2fff through ppuPage, 1K pages, $3000 - $3fff repeats them.
+Reads are one index into those tables.
+
+A write to the mapper only changes its registers in the machine, then
+banks points the pages at what they select. Switching a bank is a
+pointer store, nothing is copied. The tables belong to the console,
+restoring a snapshot rebuilds them with mapBanks.
+*/
+
+int prgBanks; // 8K banks of PRG ROM
+int chrBanks; // 1K banks of CHR ROM or RAM
+
+int bankMod(int bank, int n){
+    bank %= n;
+    return bank < 0 ? bank + n : bank;
+}
+
+// put 8K bank at $8000 + slot * 8K, negative banks count from the end
+void mapPrg8(int slot, int bank){
+    console->prgPage[slot] = prgRom + bankMod(bank, prgBanks) * 0x2000;
+}
+
+// 16K bank at $8000 + slot * 8K
+void mapPrg16(int slot, int bank){
+    mapPrg8(slot, bank * 2);
+    mapPrg8(slot + 1, bank * 2 + 1);
+}
+
+// n 1K pages from bank (in n K banks) at ppu slot * 1K
+void mapChr(int slot, int bank, int n){
+    const unsigned char *chr = chrRom ? chrRom : nes->chrRam;
+    for(int i = 0; i < n; i++){
+        console->ppuPage[slot + i] = chr + bankMod(bank * n + i, chrBanks) * 0x400;
+    }
+}
+
+void mapNametables(int mirroring){
+    // which 1K of vram each of $2000 $2400 $2800 $2c00 is
+    static const int layouts[5][4] = {
+        [MIRROR_HORIZONTAL] = {0, 0, 1, 1},
+        [MIRROR_VERTICAL] = {0, 1, 0, 1},
+        [MIRROR_FOUR_SCREEN] = {0, 1, 0, 1}, // refused by readRom
+        [MIRROR_SINGLE_LOW] = {0, 0, 0, 0},
+        [MIRROR_SINGLE_HIGH] = {1, 1, 1, 1}
+    };
+    for(int i = 0; i < 4; i++){
+        console->ppuPage[8 + i] = console->ppuPage[12 + i] = nes->vram + layouts[mirroring][i] * 0x400;
+    }
+}
+
+void mapBanks(){
+    cartMapper->banks();
+    mapNametables(nes->mapper.mirroring);
+}
+
+void resetMapper(){
+    memset(&nes->mapper, 0, sizeof nes->mapper);
+    nes->mapper.mirroring = cart.mirroring;
+    if(cartMapper->reset) cartMapper->reset();
+    mapBanks();
+}
+
+// 0 NROM, no registers
+void nromWrite(int addr, unsigned char byte){
+}
+
+void nromBanks(){
+    mapPrg16(0, 0);
+    mapPrg16(2, 1); // the first again if there's only 16K
+    mapChr(0, 0, 8);
+}
+
+// 2 UxROM, 16K at $8000 switched, the last 16K fixed at $c000
+void uxromWrite(int addr, unsigned char byte){
+    nes->mapper.bank[0] = byte;
+    mapBanks();
+}
+
+void uxromBanks(){
+    mapPrg16(0, nes->mapper.bank[0]);
+    mapPrg16(2, -1);
+    mapChr(0, 0, 8);
+}
+
+// 3 CNROM, 8K of CHR switched
+void cnromWrite(int addr, unsigned char byte){
+    nes->mapper.bank[0] = byte;
+    mapBanks();
+}
+
+void cnromBanks(){
+    mapPrg16(0, 0);
+    mapPrg16(2, 1);
+    mapChr(0, nes->mapper.bank[0], 8);
+}
+
+/* 1 MMC1
+Registers are written a bit at a time, five writes to a shift register.
+The fifth one's address picks the register: $8000 control, $a000 CHR
+bank 0, $c000 CHR bank 1, $e000 PRG bank. A write with bit 7 set starts
+over and puts the PRG banks back to the last 16K fixed at $c000.
+*/
+void mmc1Reset(){
+    nes->mapper.control = 0x0c;
+}
+
+void mmc1Write(int addr, unsigned char byte){
+    struct MapperState *m = &nes->mapper;
+
+    if(byte & 0x80){
+        m->shift = 0;
+        m->shiftCount = 0;
+        m->control |= 0x0c;
+        mapBanks();
+        return;
+    }
+
+    m->shift |= (byte & 1) << m->shiftCount;
+    if(++m->shiftCount < 5) return;
+
+    int reg = (addr >> 13) & 3;
+    if(reg == 0) m->control = m->shift;
+    else m->bank[reg - 1] = m->shift;
+    m->shift = 0;
+    m->shiftCount = 0;
+    mapBanks();
+}
+
+void mmc1Banks(){
+    struct MapperState *m = &nes->mapper;
+    static const int mirroring[4] = {MIRROR_SINGLE_LOW, MIRROR_SINGLE_HIGH, MIRROR_VERTICAL, MIRROR_HORIZONTAL};
+    m->mirroring = mirroring[m->control & 3];
+
+    int prg = m->bank[2] & 0x0f;
+    switch((m->control >> 2) & 3){
+        case 0:
+        case 1: mapPrg16(0, prg & ~1); mapPrg16(2, prg | 1); break;
+        case 2: mapPrg16(0, 0); mapPrg16(2, prg); break;
+        case 3: mapPrg16(0, prg); mapPrg16(2, -1); break;
+    }
+
+    if(m->control & 0x10){
+        mapChr(0, m->bank[0], 4);
+        mapChr(4, m->bank[1], 4);
+    }
+    else{
+        mapChr(0, m->bank[0] >> 1, 8);
+    }
+}
+
+/* 4 MMC3
+Eight bank registers, written by picking one at $8000 and storing to it
+at $8001. R0 and R1 are 2K of CHR, R2 - R5 1K, R6 and R7 8K of PRG. The
+second to last and last 8K are fixed. Bits 6 and 7 of the $8000 write
+swap the PRG and CHR halves around.
+
+The scanline counter counts down once per rendered scanline from the
+latch at $c000 and pulls the irq line when it reaches 0, until $e000
+acknowledges it.
+*/
+void mmc3Write(int addr, unsigned char byte){
+    struct MapperState *m = &nes->mapper;
+    switch(addr & 0xe001){
+        case 0x8000: m->control = byte; break;
+        case 0x8001: m->bank[m->control & 7] = byte; break;
+        case 0xa000:
+            if(cart.mirroring != MIRROR_FOUR_SCREEN){
+                m->mirroring = (byte & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL;
+            }
+            break;
+        case 0xa001: break; // PRG RAM protect, the RAM is always there
+        case 0xc000: m->irqLatch = byte; break;
+        case 0xc001: m->irqCounter = 0; m->irqReload = 1; break;
+        case 0xe000: m->irqEnabled = 0; m->irq = 0; break;
+        case 0xe001: m->irqEnabled = 1; break;
+    }
+    mapBanks();
+}
+
+void mmc3Banks(){
+    struct MapperState *m = &nes->mapper;
 
-    for(int i = 0; i < 4; i++) hdr.start[i] = rom[i];
-    hdr.prg_rom_size = rom[4];
-    hdr.chr_rom_size = rom[5];
-    hdr.flags6 = rom[6];
-    hdr.flags7 = rom[7];
-    hdr.flags8 = rom[8];
-    hdr.flags9 = rom[9];
-    hdr.flags10 = rom[10];
-    for(int i = 0 ; i < 5; i++) hdr.unused[i] = rom[11+i];
+    if(m->control & 0x40){
+        mapPrg8(0, -2);
+        mapPrg8(2, m->bank[6]);
+    }
+    else{
+        mapPrg8(0, m->bank[6]);
+        mapPrg8(2, -2);
+    }
+    mapPrg8(1, m->bank[7]);
+    mapPrg8(3, -1);
 
-    printf("{\n");
-    printf("\tstart = [%c %c %c %02x]\n", hdr.start[0], hdr.start[1], hdr.start[2], hdr.start[3]);
+    int big = (m->control & 0x80) ? 4 : 0; // where the 2K banks go
+    mapChr(big, m->bank[0] >> 1, 2);
+    mapChr(big + 2, m->bank[1] >> 1, 2);
+    for(int i = 0; i < 4; i++) mapChr((big ^ 4) + i, m->bank[2 + i], 1);
+}
 
-    printf("\tprg_rom_size = %d\n", hdr.prg_rom_size);
-    printf("\tchr_rom_size = %d\n", hdr.chr_rom_size);
-    printf("\tflags6 = "); printBits(hdr.flags6); printf("\n");
-    printf("\tflags7 = "); printBits(hdr.flags7); printf("\n");
-    printf("\tflags8 = "); printBits(hdr.flags8); printf("\n");
-    printf("\tflags9 = "); printBits(hdr.flags9); printf("\n");
-    printf("\tflags10 = "); printBits(hdr.flags10); printf("\n");
-    printf("\tunused = [");
-    for(int i = 0; i < 5; i++){
-        int c = hdr.unused[i];
-        if(isprint(c)) printf("%c", c);
-        else printf("%02x", c);
-        if(i < 4) printf(" ");
+void mmc3Scanline(){
+    struct MapperState *m = &nes->mapper;
+    if(m->irqCounter == 0 || m->irqReload){
+        m->irqCounter = m->irqLatch;
+        m->irqReload = 0;
     }
-    printf("]\n");
-    printf("}\n\n");
+    else{
+        m->irqCounter--;
+    }
+    if(m->irqCounter == 0 && m->irqEnabled) m->irq = 1;
+}
+
+const struct Mapper mappers[] = {
+    {0, "NROM", NULL, nromWrite, nromBanks, NULL},
+    {1, "MMC1", mmc1Reset, mmc1Write, mmc1Banks, NULL},
+    {2, "UxROM", NULL, uxromWrite, uxromBanks, NULL},
+    {3, "CNROM", NULL, cnromWrite, cnromBanks, NULL},
+    {4, "MMC3", NULL, mmc3Write, mmc3Banks, mmc3Scanline}
+};
 
+const struct Mapper * findMapper(int number){
+    for(int i = 0; i < (int)(sizeof mappers / sizeof mappers[0]); i++){
+        if(mappers[i].number == number) return &mappers[i];
+    }
+    return NULL;
+}
 
-    unsigned char mapper = 0;
-    mapper = hdr.flags6 >> 4;
-    mapper |= hdr.flags7 & 0xf0;
-    printf("mapper = %d\n", mapper);
+void openRomCache();
 
-    int prgsize = hdr.prg_rom_size * 16 * 1024;
-    int chrsize = hdr.chr_rom_size * 8 * 1024;
+int verbose = 1; // print the rom header and cpu at startup
 
-    printf("prg rom size = %d\n", prgsize);
-    printf("chr rom size = %d\n", chrsize);
+// load the cartridge from the .nes file at path, or the built in one
+// if path is NULL. Returns 0 with a message if it can't be played.
+int readRom(const char *path){
+    const unsigned char *data;
+    size_t size;
+    int mapped = 0;
 
-    for(int i = 0; i < prgsize; i++) {
-        memory[0x8000 + i] = rom[16 + i];
+    if(path){
+        data = mapFile(path, &size);
+        if(data == NULL) return 0;
+        mapped = 1;
+    }
+    else{
+#ifdef EMBEDDED_ROM
+        data = rom;
+        size = sizeof rom;
+        path = "built in rom";
+#else
+        printf("no rom, use --rom FILE\n");
+        return 0;
+#endif
     }
 
-    for(int i = 0; i < chrsize; i++) {
-        ppuMemory[i] = rom[16 + prgsize + i];
+    struct Cartridge c;
+    char problem[64] = "";
+    const struct Mapper *m = NULL;
+    const char *bad = parseCartridge(data, size, &c);
+    if(bad){
+        snprintf(problem, sizeof problem, "%s", bad);
+    }
+    else if((m = findMapper(c.mapper)) == NULL){
+        snprintf(problem, sizeof problem, "mapper %d isn't supported", c.mapper);
+    }
+    else if(c.prgSize < 0x4000 || c.prgSize % 0x2000 != 0){
+        snprintf(problem, sizeof problem, "%ld bytes of PRG ROM isn't whole banks", c.prgSize);
+    }
+    else if(c.chrSize % 0x400 != 0){
+        snprintf(problem, sizeof problem, "%ld bytes of CHR ROM isn't whole banks", c.chrSize);
+    }
+    else if(c.chrSize == 0 && c.chrRamSize > (long)sizeof nes->chrRam){
+        snprintf(problem, sizeof problem, "%ldK of CHR RAM isn't supported", c.chrRamSize / 1024);
+    }
+    else if(c.mirroring == MIRROR_FOUR_SCREEN){
+        snprintf(problem, sizeof problem, "four screen mirroring isn't supported");
     }
 
-    vectors.nmi   = (memory[0xfffb] << 8) | memory[0xfffa];
-    vectors.reset = (memory[0xfffd] << 8) | memory[0xfffc];
-    vectors.irq   = (memory[0xffff] << 8) | memory[0xfffe];
+    if(problem[0]){
+        printf("%s: %s\n", path, problem);
+        if(mapped) unmapFile(data, size);
+        return 0;
+    }
 
-    printf("nmi   @ $%04x\n", vectors.nmi);
-    printf("reset @ $%04x\n", vectors.reset);
-    printf("irq   @ $%04x\n", vectors.irq);
+    if(romFile) unmapFile(romFile, romFileSize);
+    romFile = mapped ? data : NULL;
+    romFileSize = mapped ? size : 0;
+
+    cart = c;
+    cartMapper = m;
+    prgRom = data + 16 + (c.trainer ? 512 : 0);
+    chrRom = c.chrSize ? prgRom + c.prgSize : NULL;
+    prgBanks = c.prgSize / 0x2000;
+    chrBanks = c.chrSize ? c.chrSize / 0x400 : sizeof nes->chrRam / 0x400;
+    romHash = xxh64(data, size, 0);
+
+    if(verbose){
+        printf("%s\n", path);
+        printf("{\n");
+        printf("\tformat = %s\n", c.nes2 ? "NES 2.0" : "iNES");
+        printf("\tmapper = %d", c.mapper);
+        if(c.nes2) printf(".%d", c.submapper);
+        printf(" (%s)\n", m->name);
+        printf("\tprg rom size = %ld\n", c.prgSize);
+        printf("\tchr rom size = %ld\n", c.chrSize);
+        printf("\tprg ram size = %ld (%ld battery backed)\n", c.prgRamSize + c.prgNvramSize, c.prgNvramSize);
+        printf("\tchr ram size = %ld\n", c.chrRamSize);
+        printf("\tmirroring = %s\n", c.mirroring == 2 ? "four screen" : c.mirroring ? "vertical" : "horizontal");
+        printf("\ttrainer = %d\n", c.trainer);
+        printf("\ttiming = %s\n", (const char *[]){"NTSC", "PAL", "either", "Dendy"}[c.timing]);
+        printf("}\n\n");
+
+        // every mapper here starts out with the last 8K at $e000
+        const unsigned char *top = prgRom + c.prgSize - 0x2000;
+        printf("nmi   @ $%02x%02x\n", top[0x1ffb], top[0x1ffa]);
+        printf("reset @ $%02x%02x\n", top[0x1ffd], top[0x1ffc]);
+        printf("irq   @ $%02x%02x\n", top[0x1fff], top[0x1ffe]);
+    }
 
+    openRomCache();
+    return 1;
 }
 
 void writeScreen(int row, int col, int r, int g, int b){
@@ -1689,7 +2323,7 @@ void writeScreen(int row, int col, int r, int g, int b){
         printf("col out of bounds (%d)\n", col);
         exit(-1);
     }
-    unsigned char * pixel = screenImg.data + row*screenW*4 + col*4;
+    unsigned char * pixel = console->screen + row*screenW*4 + col*4;
     pixel[0] = r;
     pixel[1] = g;
     pixel[2] = b;
@@ -1717,9 +2351,9 @@ void DrawVar(int n, const char * name, int addr, int size, Color color){
     char msg[256];
 
     if(size == 1)
-        sprintf(msg, "%s = %02x", name, memory[addr]);
+        sprintf(msg, "%s = %02x", name, peekMemory(addr));
     else if(size == 2)
-        sprintf(msg, "%s = %02x %02x", name, memory[addr], memory[addr+1]);
+        sprintf(msg, "%s = %02x %02x", name, peekMemory(addr), peekMemory(addr+1));
     else
         return;
 
@@ -1727,33 +2361,29 @@ void DrawVar(int n, const char * name, int addr, int size, Color color){
 }
 
 
-int coarseX = 0;
-struct RGB slicePalette[4]; // 0 1 2 or 3
-int renderBase = 0;
-unsigned char sliceQueue0 = 0; // up to 8 bits, dequeue 2 at a time
-unsigned char sliceQueue1 = 0; // up to 8 bits, dequeue 2 at a time
-int sliceQueueSize = 0; // number of pairs of bits
-
 int dequeue(){
-    if(sliceQueueSize == 0){
+    if(nes->sliceQueueSize == 0){
         printf("please fix the code, you should not be dequeuing from empty\n");
         exit(1);
     }
 
-    int bit0 = sliceQueue0 >> 7;
-    int bit1 = sliceQueue1 >> 7;
-    sliceQueue0 <<= 1;
-    sliceQueue1 <<= 1;
-    sliceQueueSize--;
+    int bit0 = nes->sliceQueue0 >> 7;
+    int bit1 = nes->sliceQueue1 >> 7;
+    nes->sliceQueue0 <<= 1;
+    nes->sliceQueue1 <<= 1;
+    nes->sliceQueueSize--;
     return (bit1 << 1) | bit0;
 }
 
+// a byte of the pattern tables, wherever the mapper has put them
+#define CHR_BYTE(addr) (console->ppuPage[(addr) >> 10][(addr) & 0x3ff])
+
 void fetchSlice2(int table, int patternNo, int line, unsigned char* plane0, unsigned char* plane1){
     int addr = table ? 0x1000 : 0x0000;
     addr += patternNo * 16;
     addr += line;
-    *plane0 = ppuMemory[addr];
-    *plane1 = ppuMemory[addr + 8];
+    *plane0 = CHR_BYTE(addr);
+    *plane1 = CHR_BYTE(addr + 8);
 }
 
 // form a number 0 to 3 using two bits from a slice
@@ -1763,37 +2393,91 @@ int extractFromSlice(int x, unsigned char plane0, unsigned char plane1){
     return (bit1 << 1) | bit0;
 }
 
+const unsigned char *chrTiles; // see rom cache
+
+// the number 0 to 3 at x, y of a pattern
+int patternPixel(int table, int patternNo, int y, int x){
+    int addr = (table ? 0x1000 : 0x0000) + patternNo * 16;
+    const unsigned char *p = console->ppuPage[addr >> 10] + (addr & 0x3ff);
+    if(chrTiles && chrRom) return chrTiles[(p - chrRom) * 4 + y * 8 + x];
+
+    unsigned char plane0;
+    unsigned char plane1;
+    fetchSlice2(table, patternNo, y, &plane0, &plane1);
+    return extractFromSlice(x, plane0, plane1);
+}
+
+/* rom cache
+What can be worked out from the rom alone is kept in the stash dir
+(savefile.c), named for the rom's xxh64, so short lived headless runs
+map it instead of working it out every time. For now that's chrTiles,
+the CHR ROM decoded a byte per pixel for the sprite renderer. Boards
+with CHR RAM have nothing to cache.
+*/
+const char *romCacheState = "none"; // for the cold start report
+const unsigned char *romCacheImage = NULL; // the mapping chrTiles is in
+size_t romCacheSize = 0;
+unsigned char *chrTilesBuilt = NULL; // or decoded here
+
+void decodeTiles(const unsigned char *chr, long size, unsigned char *out){
+    for(long t = 0; t < size / 16; t++){
+        for(int y = 0; y < 8; y++){
+            unsigned char plane0 = chr[t * 16 + y];
+            unsigned char plane1 = chr[t * 16 + 8 + y];
+            for(int x = 0; x < 8; x++) *out++ = extractFromSlice(x, plane0, plane1);
+        }
+    }
+}
+
+void closeRomCache(){
+    if(romCacheImage) unmapFile(romCacheImage, romCacheSize);
+    free(chrTilesBuilt);
+    romCacheImage = NULL;
+    chrTilesBuilt = NULL;
+    chrTiles = NULL;
+}
+
+// find chrTiles for the rom just loaded, in the cache or by decoding
+// them and caching them for next time
+void openRomCache(){
+    closeRomCache();
+    romCacheState = "none";
+    if(chrRom == NULL) return;
+
+    long length = cart.chrSize * 4;
+    chrTiles = mapRomCache(APP_NAME, romHash, length, &romCacheImage, &romCacheSize);
+    if(chrTiles){
+        romCacheState = "hit";
+        return;
+    }
+
+    chrTilesBuilt = malloc(length);
+    if(chrTilesBuilt == NULL) return;
+    decodeTiles(chrRom, cart.chrSize, chrTilesBuilt);
+    writeRomCache(APP_NAME, romHash, chrTilesBuilt, length);
+    chrTiles = chrTilesBuilt;
+    romCacheState = "built";
+}
+
 
 // return a final color index for sprites here, or -1 if transparent
 int loopOverSpritesHere(int bg, int line, int dot){
-    int table = ppuCtrl.spritePatternAddress; // 0 or 1
+    int table = nes->ppuCtrl.spritePatternAddress; // 0 or 1
     int result = -1;
     unsigned char code;
     for(int i = 0; i < 64; i++){
-        int y = oam[i*4];
-        int x = oam[i*4 + 3];
+        int y = nes->oam[i*4];
+        int x = nes->oam[i*4 + 3];
         if(y <= line && line <= y + 7 && x <= dot && dot <= x + 7){
-            int patternNo = oam[i*4 + 1];
-            unsigned char attr = oam[i*4 + 2];
-            unsigned char plane0;
-            unsigned char plane1;
-            if((attr >> 7) & 1){
-                fetchSlice2(table, patternNo, 7 - (line - y), &plane0, &plane1);
-            }
-            else{
-                fetchSlice2(table, patternNo, line - y, &plane0, &plane1);
-            }
-            if((attr >> 6) & 1){
-                code = extractFromSlice(7 - (dot - x), plane0, plane1);
-            }
-            else{
-                code = extractFromSlice(dot - x, plane0, plane1);
-            }
+            int patternNo = nes->oam[i*4 + 1];
+            unsigned char attr = nes->oam[i*4 + 2];
+            int row = ((attr >> 7) & 1) ? 7 - (line - y) : line - y;
+            int col = ((attr >> 6) & 1) ? 7 - (dot - x) : dot - x;
+            code = patternPixel(table, patternNo, row, col);
             if(code != 0x00){
                 int behindBg = (attr >> 5) & 1;
                 if(!(bg && behindBg)){
-                    int palBase = 0x3f10 + 4*(attr & 3);
-                    result = ppuMemory[palBase + code];
+                    result = nes->palette[0x10 + 4*(attr & 3) + code];
                 }
             }
         }
@@ -1803,8 +2487,10 @@ int loopOverSpritesHere(int bg, int line, int dot){
 
 void fetchSlice(int line, int coarseX){
 
+    const unsigned char *nametable = console->ppuPage[8 + nes->renderTable];
+
     // get palette
-    unsigned char attr = ppuMemory[renderBase + 0x03c0 + (line/32)*8 + coarseX/4];
+    unsigned char attr = nametable[0x03c0 + (line/32)*8 + coarseX/4];
     //int paletteNo = (attr >> 0) & 3; // top left
     //int paletteNo = (attr >> 2) & 3; // top right
     //int paletteNo = (attr >> 4) & 3; // bottom left
@@ -1816,130 +2502,138 @@ void fetchSlice(int line, int coarseX){
     if(!row &&  col) paletteNo = (attr >> 2) & 3;
     if( row && !col) paletteNo = (attr >> 4) & 3;
     if( row &&  col) paletteNo = (attr >> 6) & 3;
-    int palBase = 0x3f00 + paletteNo * 4;
     for(int i = 0; i < 4; i++){
-        int code = ppuMemory[palBase + i];
-        slicePalette[i] = colors[code];
+        int code = nes->palette[paletteNo * 4 + i];
+        nes->slicePalette[i] = colors[code];
     }
-    slicePalette[0] = colors[ppuMemory[0x3f00]]; // universal bg color
+    nes->slicePalette[0] = colors[nes->palette[0]]; // universal bg color
 
     // get slice
-    int patternNo   = ppuMemory[renderBase + (line/8)*32 + coarseX];
-    int patternBase = ppuCtrl.bgPatternAddress ? 0x1000 : 0x0000;
+    int patternNo   = nametable[(line/8)*32 + coarseX];
+    int patternBase = nes->ppuCtrl.bgPatternAddress ? 0x1000 : 0x0000;
     int sliceNo = line % 8;
 
-    sliceQueue0 = ppuMemory[patternBase + patternNo*16 + sliceNo];
-    sliceQueue1 = ppuMemory[patternBase + patternNo*16 + 8 + sliceNo];
-    sliceQueueSize = 8;
+    nes->sliceQueue0 = CHR_BYTE(patternBase + patternNo*16 + sliceNo);
+    nes->sliceQueue1 = CHR_BYTE(patternBase + patternNo*16 + 8 + sliceNo);
+    nes->sliceQueueSize = 8;
 
 }
 
 
 
 
-int nmiComing = 0;
-int nmiHappening = 0;
-int cpuDots = 1;
-int triplet = 3;
+void movieFrame();
+
 int stepPPU(){ // outputs 1 dot, return 1 if instruction completed
 
-    if(dmaFlag){
-        dmaFlag = 0;
+    if(nes->dot == 0 && nes->scanline == 0 && console->movie) movieFrame();
+
+    if(nes->dmaFlag){
+        nes->dmaFlag = 0;
         //cpuDots += 3 * 513;
     }
 
-    if(dot == 0 && scanline < 240){
+    if(nes->dot == 0 && nes->scanline < 240){
 //        findSpritesOnLine(scanline + 1); // 
     }
 
     // process 1 dot here
     // compute background pixel
     // consult scanline's sprite buffer
-    if(dot < 256 && scanline >= 1 && scanline <= 240){
+    if(nes->dot < 256 && nes->scanline >= 1 && nes->scanline <= 240){
 
-        if(dot == 0){
-            renderBase = ppuCtrl.nametableBase ? 0x2400 : 0x2000;
-            coarseX = ppuScrollX / 8;
-            fetchSlice(scanline - 1, coarseX);
-            for(int i = 0; i < ppuFineX; i++) dequeue();
+        if(nes->dot == 0){
+            nes->renderTable = nes->ppuCtrl.nametableBase;
+            nes->coarseX = nes->ppuScrollX / 8;
+            fetchSlice(nes->scanline - 1, nes->coarseX);
+            for(int i = 0; i < nes->ppuFineX; i++) dequeue();
         }
 
-        if(sliceQueueSize == 0){
-            if(coarseX == 31){
-                coarseX = 0;
-                renderBase = (renderBase == 0x2000) ? 0x2400 : 0x2000;
+        if(nes->sliceQueueSize == 0){
+            if(nes->coarseX == 31){
+                nes->coarseX = 0;
+                nes->renderTable ^= 1;
             }
             else{
-                coarseX++;
+                nes->coarseX++;
             }
-            fetchSlice(scanline - 1, coarseX);
+            fetchSlice(nes->scanline - 1, nes->coarseX);
         }
 
         int bg = dequeue(); // the background pixel
-        int fg = loopOverSpritesHere(bg, scanline - 1, dot); // sprite pixel, if any
 
-        struct RGB color;
-        if(fg < 0){
-            color = slicePalette[bg];
-        }
-        else{
-            color = colors[fg];
+        if(console->screen){
+            int fg = loopOverSpritesHere(bg, nes->scanline - 1, nes->dot); // sprite pixel, if any
+
+            struct RGB color;
+            if(fg < 0){
+                color = nes->slicePalette[bg];
+            }
+            else{
+                color = colors[fg];
+            }
+            writeScreen(nes->scanline-1, nes->dot, color.r, color.g, color.b);
         }
-        writeScreen(scanline-1, dot, color.r, color.g, color.b);
 
     }
 
-    dot++;
-    if(dot == 341){
-        dot = 0;
-        scanline++;
+    // the MMC3 counts scanlines by watching the ppu fetch sprite patterns
+    if(nes->dot == 260 && nes->scanline <= 240 && cartMapper->scanline){
+        if(nes->ppuMask.showBackground || nes->ppuMask.showSprites) cartMapper->scanline();
+    }
 
-        if(scanline == 241){
-            ppuStatus.inVblank = 1;
-            if(ppuCtrl.nmiOutput){ nmiComing = 1; }
-        }
+    nes->dot++;
+    if(nes->dot == 341){
+        nes->dot = 0;
+        nes->scanline++;
 
-        if(scanline == 262){
-            scanline = 0;
-            ppuStatus.inVblank = 0;
-            ppuStatus.spriteZeroHit = 0;
-            frameNo++;
+        if(nes->scanline == 241){
+            nes->ppuStatus.inVblank = 1;
+            if(nes->ppuCtrl.nmiOutput){ nes->nmiComing = 1; }
         }
-    }
 
-    if(dot == oam[3] && scanline - 1 == oam[0] + 5 && /* sprite0 and bg not transparent */ 1){
-        ppuStatus.spriteZeroHit = 1;
+        if(nes->scanline == 262){
+            nes->scanline = 0;
+            nes->ppuStatus.inVblank = 0;
+            nes->ppuStatus.spriteZeroHit = 0;
+            nes->frameNo++;
+        }
     }
 
-
-    triplet--;
-    if(triplet == 0){
-        triplet = 3;
-        apuFrameHalfClock();
+    if(nes->dot == nes->oam[3] && nes->scanline - 1 == nes->oam[0] + 5 && /* sprite0 and bg not transparent */ 1){
+        nes->ppuStatus.spriteZeroHit = 1;
     }
 
 
     // make 1 dots of progress on CPU
-    cpuDots--;
-    if(cpuDots == 0){
-        if(nmiHappening){
+    nes->cpuDots--;
+    if(nes->cpuDots == 0){
+        if(nes->nmiHappening){
             nmiCPU();
-            cpuDots = 3 * nextCPUDelay();
-            nmiHappening = 0;
+            nes->cpuDots = 3 * nextCPUDelay();
+            nes->nmiHappening = 0;
             // inhibit nmi now so 1 instruction at least gets executed
         }
-        else if(nmiComing){
+        else if(nes->nmiComing){
             stepCPU();
-            cpuDots = 3 * 7;
-            nmiHappening = 1;
-            nmiComing = 0;
+            nes->cpuDots = 3 * 7;
+            nes->nmiHappening = 1;
+            nes->nmiComing = 0;
+        }
+        else if(nes->mapper.irq && !nes->regs.P.interruptDisable){
+            interruptCPU(0xfffe);
+            nes->cpuDots = 3 * 7;
         }
         else{
             stepCPU();
-            cpuDots = 3 * nextCPUDelay();
+            nes->cpuDots = 3 * nextCPUDelay();
             // clear nmi inhibiting
         }
 
+        // the apu timestamps writes by cpu cycle, count them a whole
+        // instruction at a time rather than every 3 dots
+        apuClock(nes->cpuDots / 3);
+
         return 1;
     }
 
@@ -1955,7 +2649,7 @@ void drawByte(int x, int y, unsigned char byte){
 }
 
 void drawSwatch(int x, int y, int pal){
-    int index = ppuMemory[0x3f00 + pal];
+    int index = nes->palette[pal];
     struct RGB *color = &colors[index];
     struct Color c = {color->r, color->g, color->b, 255};
     DrawRectangle(x, y, 32, 32, c);
@@ -2012,202 +2706,718 @@ void drawPalettes(){
     drawSwatch(32*3,32*(5+3),31);
 }
 
-pthread_mutex_t audio_mutex;
-
-#define AUDIO_BUFFER_SIZE (2 * 4096)
+// audio goes from the main thread (producer) to the audio device
+// callback (consumer) through this ring without any locking. The head
+// is only written by the producer and the tail only by the consumer.
+// They count up forever and get masked when used as indexes.
+#define AUDIO_BUFFER_SIZE (2 * 4096) // must be a power of two
+#define AUDIO_BUFFER_MASK (AUDIO_BUFFER_SIZE - 1)
 float audio_buffer[AUDIO_BUFFER_SIZE];
-unsigned audio_buffer_ptr = 0;
-unsigned audio_buffer_base = 0;
-unsigned audio_buffer_amount = 0;
-int silence = 0;
+atomic_uint audio_head = 0;
+atomic_uint audio_tail = 0;
 
+// audio off (TAB): synth still keeps the APU state going, but nothing is
+// generated, nothing goes in the ring and the device plays zeros
+atomic_int audioOff = 0;
 
-void generate(unsigned numSamples){
-    pthread_mutex_lock(&audio_mutex);
+unsigned audioBufferAmount(){
+    unsigned head = atomic_load_explicit(&audio_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&audio_tail, memory_order_acquire);
+    return head - tail;
+}
 
-    if(numSamples >= AUDIO_BUFFER_SIZE - audio_buffer_amount){
-        printf("audio buffer overflow :(\n");
-        return;
+// The cpu is paced by the host clock (frame pacing, below), which is
+// close to but not exactly in step with the audio device clock. So synth
+// output goes through a resampler on its way into the ring, which
+// stretches or squeezes it by a fraction of a percent to keep the ring
+// near AUDIO_TARGET samples full. With --pace-audio the frame pacer does
+// that job by speeding up or slowing down the cpu, and the resampler
+// stays at 1:1.
+#define AUDIO_TARGET 882     // 20ms at 44100Hz
+#define AUDIO_MAX_SKEW 0.005 // largest allowed deviation from 1:1
+float resampleIn[AUDIO_BUFFER_SIZE];
+float resamplePrev = 0.0; // last input sample of the previous batch
+double resamplePos = 0.0; // in input samples, 0 = resamplePrev
+double resampleRatio = 1.0; // output samples per input sample
+atomic_uint audio_underruns = 0;
+unsigned audio_overruns = 0;
+int paceAudio = 0; // --pace-audio
+
+// synthesize numSamples and resample them into the ring
+void generate(unsigned numSamples){
+    if(numSamples == 0) return;
+    if(numSamples > AUDIO_BUFFER_SIZE) numSamples = AUDIO_BUFFER_SIZE;
+
+    synth(resampleIn, numSamples);
+
+    unsigned head = atomic_load_explicit(&audio_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&audio_tail, memory_order_acquire);
+    unsigned fill = head - tail;
+
+    double error = ((double)AUDIO_TARGET - fill) / AUDIO_TARGET;
+    if(error >  1.0) error =  1.0;
+    if(error < -1.0) error = -1.0;
+    if(paceAudio) error = 0.0;
+    resampleRatio = 1.0 + AUDIO_MAX_SKEW * error;
+
+    double step = 1.0 / resampleRatio;
+    double pos = resamplePos;
+    unsigned space = AUDIO_BUFFER_SIZE - fill;
+    unsigned written = 0;
+    int dropped = 0;
+
+    while(pos < numSamples){
+        int i = pos;
+        float frac = pos - i;
+        float a = i == 0 ? resamplePrev : resampleIn[i - 1];
+        float b = resampleIn[i];
+        if(written < space){
+            audio_buffer[(head + written) & AUDIO_BUFFER_MASK] = a + frac * (b - a);
+            written++;
+        }
+        else{
+            dropped = 1;
+        }
+        pos += step;
     }
 
-    if(AUDIO_BUFFER_SIZE - audio_buffer_ptr < numSamples){
-        int half1 = AUDIO_BUFFER_SIZE - audio_buffer_ptr;
-        int half2 = numSamples - half1;
-        synth(&audio_buffer[audio_buffer_ptr], half1);
-        synth(&audio_buffer[0], half2);
-        audio_buffer_ptr = half2;
-        audio_buffer_amount += numSamples;
+    resamplePos = pos - numSamples;
+    resamplePrev = resampleIn[numSamples - 1];
+    if(dropped) audio_overruns++;
+
+    atomic_store_explicit(&audio_head, head + written, memory_order_release);
+}
+
+// put silence in the buffer without advancing synth
+void generateSilence(unsigned numSamples){
+    unsigned head = atomic_load_explicit(&audio_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&audio_tail, memory_order_acquire);
+
+    if(numSamples > AUDIO_BUFFER_SIZE - (head - tail)){
+        numSamples = AUDIO_BUFFER_SIZE - (head - tail);
     }
-    else{
-        synth(&audio_buffer[audio_buffer_ptr], numSamples);
-        audio_buffer_ptr += numSamples;
-        audio_buffer_amount += numSamples;
-        if(audio_buffer_ptr == AUDIO_BUFFER_SIZE) audio_buffer_ptr = 0;
+
+    for(unsigned i = 0; i < numSamples; i++){
+        audio_buffer[(head + i) & AUDIO_BUFFER_MASK] = 0.0;
     }
 
-    pthread_mutex_unlock(&audio_mutex);
+    atomic_store_explicit(&audio_head, head + numSamples, memory_order_release);
 }
 
 void AudioCb(void *buffer, unsigned int numWanted){
     int16_t *out = buffer;
     float amplitude;
 
-    if(audio_buffer_amount < numWanted){
-        printf("audio drop out :(\n");
-        for(unsigned i = 0; i < numWanted; i++){
-            out[i] = 0;
-        }
+    if(atomic_load_explicit(&audioOff, memory_order_relaxed)){
+        // throw away whatever was left so it doesn't play when turned back on
+        unsigned head = atomic_load_explicit(&audio_head, memory_order_acquire);
+        atomic_store_explicit(&audio_tail, head, memory_order_release);
+        memset(out, 0, numWanted * sizeof(int16_t));
+        return;
+    }
+
+    unsigned tail = atomic_load_explicit(&audio_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&audio_head, memory_order_acquire);
+
+    unsigned available = head - tail;
+    if(available < numWanted){
+        // play what there is, then silence
+        atomic_fetch_add_explicit(&audio_underruns, 1, memory_order_relaxed);
     }
     else{
-        pthread_mutex_lock(&audio_mutex);
-        for(unsigned i = 0; i < numWanted; i++){
-            amplitude = audio_buffer[audio_buffer_base];
-            amplitude = amplitude > 1.0f ? 1.0 : amplitude;
-            amplitude = amplitude < -1.0f ? -1.0 : amplitude;
-            if(silence) amplitude = 0.0;
-            out[i] = amplitude * INT16_MAX;
-            audio_buffer_base++;
-            audio_buffer_amount--;
-            if(audio_buffer_base == AUDIO_BUFFER_SIZE) audio_buffer_base = 0;
-        }
-        pthread_mutex_unlock(&audio_mutex);
+        available = numWanted;
     }
-}
 
+    for(unsigned i = 0; i < available; i++){
+        amplitude = audio_buffer[(tail + i) & AUDIO_BUFFER_MASK];
+        amplitude = amplitude > 1.0f ? 1.0 : amplitude;
+        amplitude = amplitude < -1.0f ? -1.0 : amplitude;
+        out[i] = amplitude * INT16_MAX;
+    }
+    for(unsigned i = available; i < numWanted; i++){
+        out[i] = 0;
+    }
 
-int saveSlot = 1;
-
-void setSaveSlot(int n){
-    saveSlot = n;
-    printf("save slot %d selected\n", n);
+    atomic_store_explicit(&audio_tail, tail + available, memory_order_release);
 }
 
-void encodeIntBE(long i, unsigned char buf[4]){
+void toggleAudio(){
+    if(audioOff){
+        resamplePrev = 0.0;
+        resamplePos = 0.0;
+        atomic_store(&audioOff, 0);
+        generateSilence(AUDIO_TARGET);
+    }
+    else{
+        atomic_store(&audioOff, 1);
+    }
+    printf("audio %s\n", audioOff ? "off" : "on");
+}
 
-    unsigned long u;
+/* frame pacing
+The window shows one NES frame per host frame, so host frames have to
+come every 1/60.0988s (262 lines of 341 dots at 5.369318MHz). paceFrame
+waits for the end of the current one against CLOCK_MONOTONIC. Sleeping
+is only good to a millisecond or so, so it sleeps until PACE_SPIN_NS
+before the deadline and spins the rest of the way. Deadlines are
+absolute, a late frame is made up by the next ones, unless it's so late
+(a breakpoint, the window being dragged) that it's better to start over.
+
+With --pace-audio the period follows the audio ring instead: up to
+AUDIO_MAX_SKEW longer when it's over AUDIO_TARGET, shorter when under.
+That keeps the cpu in step with the audio device clock without
+resampling.
+
+The last FRAME_TIMES host frame times are kept for the debug overlay.
+*/
+#define NTSC_FRAME_NS 16639267LL // 1e9 / 60.0988
+#define PACE_SPIN_NS 1500000LL
+#define PACE_RESYNC_NS 100000000LL // give up catching up after 100ms
+#define FRAME_TIMES 256
+
+long long paceDeadline = 0; // ns, 0 = not started
+long long paceLast = 0;
+double frameTimes[FRAME_TIMES]; // seconds
+int frameTimeCount = 0;
+int frameTimeNext = 0;
+double frameTimeP50 = 0.0;
+double frameTimeP99 = 0.0;
+
+long long monotonicNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-    if(i >= 0)
-        u = i;
-    else
-        u = 0xffffffffL + i + 1;
+int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-    buf[0] = (u >> 24) & 0xff;
-    buf[1] = (u >> 16) & 0xff;
-    buf[2] = (u >>  8) & 0xff;
-    buf[3] = (u >>  0) & 0xff;
+void updateFrameTimeStats(){
+    double sorted[FRAME_TIMES];
+    memcpy(sorted, frameTimes, frameTimeCount * sizeof(double));
+    qsort(sorted, frameTimeCount, sizeof(double), compareDoubles);
+    frameTimeP50 = sorted[frameTimeCount / 2];
+    frameTimeP99 = sorted[frameTimeCount * 99 / 100];
+}
 
+long long framePeriod(){
+    if(!paceAudio || audioOff) return NTSC_FRAME_NS;
+    double error = ((double)audioBufferAmount() - AUDIO_TARGET) / AUDIO_TARGET;
+    if(error >  1.0) error =  1.0;
+    if(error < -1.0) error = -1.0;
+    return NTSC_FRAME_NS + (long long)(NTSC_FRAME_NS * AUDIO_MAX_SKEW * error);
 }
 
-long decodeIntBE(unsigned char buf[4]){
-    
-    unsigned long u = 0;
+// wait for the end of this host frame
+void paceFrame(){
+    long long now = monotonicNs();
+    if(paceDeadline == 0){
+        paceDeadline = now;
+        paceLast = now;
+    }
 
-    u |= buf[3] <<  0;
-    u |= buf[2] <<  8;
-    u |= buf[1] << 16;
-    u |= buf[0] << 24;
+    paceDeadline += framePeriod();
+    if(now > paceDeadline + PACE_RESYNC_NS) paceDeadline = now;
 
-    if(u < 0x7ffffffL)
-        return u;
-    else
-        return (0xffffffffL - u) - 1;
+    long long sleep = paceDeadline - now - PACE_SPIN_NS;
+    if(sleep > 0){
+        struct timespec ts = {sleep / 1000000000LL, sleep % 1000000000LL};
+        nanosleep(&ts, NULL);
+    }
+    do now = monotonicNs(); while(now < paceDeadline);
 
+    frameTimes[frameTimeNext] = (now - paceLast) / 1e9;
+    frameTimeNext = (frameTimeNext + 1) % FRAME_TIMES;
+    if(frameTimeCount < FRAME_TIMES) frameTimeCount++;
+    paceLast = now;
+    if(frameTimeNext % 30 == 0) updateFrameTimeStats();
 }
 
-void putInt(FILE * file, long i){
-    unsigned char buf[4];
-    encodeIntBE(i, buf);
-    int n = fwrite(buf, 1, 4, file);
-    if(n < 4){
-        printf("putInt failed: %s\n", strerror(errno));
+int saveSlot = 1;
+
+void setSaveSlot(int n){
+    saveSlot = n;
+    printf("save slot %d selected\n", n);
+}
+
+// copy the whole machine into buf, which holds machineSnapshotSize() bytes
+int machineSnapshotSize(){
+    return sizeof(struct Machine);
+}
+
+void snapshotMachine(void *buf){
+    memcpy(buf, nes, sizeof(struct Machine));
+}
+
+// put the machine back the way it was when buf was taken. Returns 0 and
+// leaves the machine alone if buf isn't a snapshot of this version.
+int restoreMachine(const void *buf){
+    const struct Machine *m = buf;
+    if(m->version != MACHINE_VERSION || m->size != sizeof(struct Machine)){
+        printf(
+            "snapshot version %d size %d, expected version %d size %d\n",
+            m->version, m->size, MACHINE_VERSION, (int)sizeof(struct Machine)
+        );
+        return 0;
+    }
+    memcpy(nes, buf, sizeof(struct Machine));
+    markAllDirty();
+    mapBanks();
+    return 1;
+}
+
+// pages copied by the last snapshotChanges, of MACHINE_PAGES
+int lastSnapshotPages = 0;
+
+// hand what's been written since last time to every track
+void collectDirty(){
+    for(int w = 0; w < PAGE_WORDS; w++){
+        for(int t = 0; t < TRACKS; t++) console->pending[t][w] |= console->dirty[w];
+        console->dirty[w] = 0;
+    }
+}
+
+// copy the pages in mask from in to out, a run of them at a time.
+// Returns the number of pages copied.
+int copyPages(unsigned char *out, const unsigned char *in, const unsigned long long *mask){
+    int copied = 0;
+    for(int w = 0; w < PAGE_WORDS; w++){
+        unsigned long long bits = mask[w];
+        while(bits){
+            int first = __builtin_ctzll(bits);
+            unsigned long long past = bits + (1ULL << first); // the run carried out
+            int end = past ? __builtin_ctzll(past) : 64;
+            bits &= past;
+
+            int from = (w * 64 + first) * DIRTY_PAGE_SIZE;
+            int to = (w * 64 + end) * DIRTY_PAGE_SIZE;
+            if(to > (int)sizeof(struct Machine)) to = sizeof(struct Machine);
+            memcpy(out + from, in + from, to - from);
+            copied += end - first;
+        }
+    }
+    return copied;
+}
+
+// the pages a track has to copy
+void trackMask(int track, unsigned long long *mask){
+    collectDirty();
+    for(int w = 0; w < PAGE_WORDS; w++){
+        mask[w] = console->synced[track] ? console->pending[track][w] | pageAlways[w] : pageAll[w];
+    }
+}
+
+// like snapshotMachine, for a buf that's only ever used with track on
+// this console. What hasn't been written since its last snapshot isn't
+// copied again.
+void snapshotChanges(void *buf, int track){
+    unsigned long long mask[PAGE_WORDS];
+    initPageTables();
+    trackMask(track, mask);
+    lastSnapshotPages = copyPages(buf, (const unsigned char *)nes, mask);
+    for(int w = 0; w < PAGE_WORDS; w++) console->pending[track][w] = 0;
+    console->synced[track] = 1;
+}
+
+// put the machine back to buf, the snapshot on track. Only what's been
+// written since it was taken is copied back.
+void restoreChanges(const void *buf, int track){
+    unsigned long long mask[PAGE_WORDS];
+    trackMask(track, mask);
+    copyPages((unsigned char *)nes, buf, mask);
+
+    // what came back is as good as written for the other tracks
+    for(int w = 0; w < PAGE_WORDS; w++){
+        for(int t = 0; t < TRACKS; t++) console->pending[t][w] |= mask[w] & ~pageAlways[w];
+        console->pending[track][w] = 0;
+    }
+    mapBanks();
+}
+
+// the buf on track was overwritten, the next snapshot copies everything
+void forgetChanges(int track){
+    console->synced[track] = 0;
+}
+
+// pages written to since the last call, once per frame for the overlay
+int dirtyLastFrame = 0;
+long dirtyTotal = 0;
+long dirtyFrames = 0;
+
+void countDirtyPages(){
+    int n = 0;
+    initPageTables();
+    collectDirty();
+    for(int w = 0; w < PAGE_WORDS; w++){
+        n += __builtin_popcountll(console->pending[TRACK_FRAME][w] & ~pageAlways[w]);
+        console->pending[TRACK_FRAME][w] = 0;
+    }
+    dirtyLastFrame = n;
+    dirtyTotal += n;
+    dirtyFrames++;
+}
+
+// a fresh machine, with the apu running inside it
+void powerOn(){
+    *nes = machinePowerOn;
+    apuAttach(nes->apu, APU_STATE_SIZE);
+    initAPU();
+    resetMapper();
+    markAllDirty();
+}
+
+// run c on this thread from now on
+void selectConsole(struct Console *c){
+    console = c;
+    nes = &c->machine;
+    apuAttach(nes->apu, APU_STATE_SIZE);
+}
+
+// a new console, powered on, reset and selected on this thread. The
+// cartridge has to be loaded already. Returns NULL if out of memory.
+struct Console *createConsole(int withScreen){
+    struct Console *c = calloc(1, sizeof(struct Console));
+    if(c == NULL) return NULL;
+
+    if(withScreen){
+        c->screen = malloc(screenW * screenH * 4);
+        if(c->screen == NULL){
+            free(c);
+            return NULL;
+        }
+    }
+
+    selectConsole(c);
+    powerOn();
+    resetCPU();
+    return c;
+}
+
+void destroyConsole(struct Console *c){
+    if(console == c) selectConsole(&mainConsole);
+    free(c->screen);
+    free(c);
+}
+
+// select c and emulate one frame of it, audio is left pending in its apu
+void runFrame(struct Console *c){
+    selectConsole(c);
+    for(int i = 0; i < 262 * 341; i++){
+        stepPPU();
+    }
+}
+
+// rewind history, see rewind.c
+#define REWIND_ARENA_SIZE (8 << 20)
+#define REWIND_BUDGET 0.0002 // seconds per frame we're willing to spend
+int rewindEvery = 1; // frames between snapshots, 0 = off
+int rewindLastFrame = -1;
+unsigned char *rewindSnap = NULL;
+
+void startRewind(){
+    if(rewindEvery <= 0) return;
+    initRewind(machineSnapshotSize(), REWIND_ARENA_SIZE);
+    rewindSnap = malloc(machineSnapshotSize());
+    if(rewindSnap == NULL){
+        printf("rewind: out of memory\n");
         exit(1);
     }
 }
 
-void putBlob(FILE * file, const unsigned char * ptr, size_t n){
-    int written = fwrite(ptr, 1, n, file);
-    if(written < n){
-        printf("putBlob n=%zu failed: %s\n", n, strerror(errno));
+// called once per pass through the main loop, snapshots a new frame
+void recordRewind(){
+    if(rewindSnap == NULL) return;
+    if(nes->frameNo == rewindLastFrame) return;
+    if(nes->frameNo % rewindEvery != 0) return;
+    snapshotChanges(rewindSnap, TRACK_REWIND);
+    rewindPush(rewindSnap);
+    rewindLastFrame = nes->frameNo;
+}
+
+// go back one snapshot and show it. The frame after the snapshot is run
+// to get a picture, then the snapshot is put back so nothing drifts.
+void stepBackward(){
+    if(rewindSnap == NULL) return;
+    if(!rewindPop(rewindSnap)) return;
+    forgetChanges(TRACK_REWIND);
+    restoreMachine(rewindSnap);
+    for(int i = 0; i < 262 * 341; i++) stepPPU();
+    restoreMachine(rewindSnap);
+    rewindLastFrame = nes->frameNo;
+    if(console->movie) movieTruncate(console->movie, nes->frameNo);
+}
+
+// crc of the rom a save was made with, so it won't load into another game.
+// A 16K PRG ROM is counted twice, the way it shows up at $8000.
+unsigned long romCrc(){
+    unsigned long crc = 0;
+    for(long n = 0; n < 0x8000; n += cart.prgSize) crc = crc32Update(crc, prgRom, cart.prgSize);
+    return chrRom ? crc32Update(crc, chrRom, cart.chrSize) : crc;
+}
+
+// movie of the main console, see movie.c
+int movieKeyInterval = 600;
+const char *moviePath = NULL;
+unsigned char *movieSnap = NULL;
+const char *recordPath = NULL; // --record
+const char *playPath = NULL; // --play
+
+#ifdef EMBEDDED_ROM
+const char *romPath = NULL; // --rom, NULL for the one built in
+#else
+const char *romPath = "rom.nes"; // --rom
+#endif
+int seekFrame = -1; // --seek
+
+// record from here on into path, written out by finishMovie
+void startRecording(const char *path){
+    movieSnap = malloc(machineSnapshotSize());
+    console->movie = newMovie(machineSnapshotSize(), movieKeyInterval, nes->frameNo);
+    if(movieSnap == NULL || console->movie == NULL){
+        printf("movie: out of memory\n");
         exit(1);
     }
+    moviePath = path;
+    snapshotMachine(movieSnap);
+    movieAddKey(console->movie, nes->frameNo, movieSnap);
+    printf("recording %s from frame %d\n", path, nes->frameNo);
 }
 
-long getInt(FILE * file){
-    unsigned char buf[4];
-    int n = fread(buf, 1, 4, file);
-    if(n < 4){
-        printf("getInt failed: %s\n", strerror(errno));
+// play path back from its first frame. Returns 0 if it can't be loaded.
+int startPlayback(const char *path){
+    movieSnap = malloc(machineSnapshotSize());
+    if(movieSnap == NULL){
+        printf("movie: out of memory\n");
         exit(1);
     }
-    return decodeIntBE(buf);
+
+    struct Movie *m = loadMovie(path, machineSnapshotSize(), romCrc());
+    if(m == NULL) return 0;
+
+    movieFindKey(m, movieStart(m), movieSnap);
+    if(!restoreMachine(movieSnap)){
+        freeMovie(m);
+        return 0;
+    }
+    console->movie = m;
+    printf("playing %s, frames %d to %d\n", path, movieStart(m), movieEnd(m));
+    return 1;
+}
+
+/* what's different
+The fields of struct Machine, to say which of them differ between two
+machines that should be the same, like a replay and the keyframe it was
+recorded with. Arrays are told byte by byte, the apu's space field by
+field (apu.c).
+*/
+struct MachineField {
+    const char *name;
+    int offset;
+    int size;
+};
+
+#define MACHINE_FIELD(f) {#f, offsetof(struct Machine, f), sizeof(((struct Machine *)0)->f)}
+
+const struct MachineField machineFields[] = {
+    MACHINE_FIELD(version), MACHINE_FIELD(size),
+    MACHINE_FIELD(regs.A), MACHINE_FIELD(regs.X), MACHINE_FIELD(regs.Y), MACHINE_FIELD(regs.S),
+    MACHINE_FIELD(regs.PC), MACHINE_FIELD(regs.P.carry), MACHINE_FIELD(regs.P.zero),
+    MACHINE_FIELD(regs.P.interruptDisable), MACHINE_FIELD(regs.P.decimal),
+    MACHINE_FIELD(regs.P.overflow), MACHINE_FIELD(regs.P.negative),
+    MACHINE_FIELD(nmiComing), MACHINE_FIELD(nmiHappening), MACHINE_FIELD(cpuDots),
+    MACHINE_FIELD(dmaFlag),
+    MACHINE_FIELD(frameNo), MACHINE_FIELD(scanline), MACHINE_FIELD(dot),
+    MACHINE_FIELD(ppuAddr), MACHINE_FIELD(oamAddr), MACHINE_FIELD(ppuT), MACHINE_FIELD(ppuX),
+    MACHINE_FIELD(ppuW), MACHINE_FIELD(ppuScrollX), MACHINE_FIELD(ppuScrollY),
+    MACHINE_FIELD(ppuNameBase), MACHINE_FIELD(ppuFineX), MACHINE_FIELD(ppuDataReadBuffer),
+    MACHINE_FIELD(ppuCtrlByte),
+    MACHINE_FIELD(ppuCtrl.nametableBase), MACHINE_FIELD(ppuCtrl.vramAddressIncrement),
+    MACHINE_FIELD(ppuCtrl.spritePatternAddress), MACHINE_FIELD(ppuCtrl.bgPatternAddress),
+    MACHINE_FIELD(ppuCtrl.spriteSize), MACHINE_FIELD(ppuCtrl.extMaster),
+    MACHINE_FIELD(ppuCtrl.nmiOutput),
+    MACHINE_FIELD(ppuMask.emphasisB), MACHINE_FIELD(ppuMask.emphasisG),
+    MACHINE_FIELD(ppuMask.emphasisR), MACHINE_FIELD(ppuMask.showSprites),
+    MACHINE_FIELD(ppuMask.showBackground), MACHINE_FIELD(ppuMask.showSpritesLeft),
+    MACHINE_FIELD(ppuMask.showBackgroundLeft), MACHINE_FIELD(ppuMask.grayscale),
+    MACHINE_FIELD(ppuStatus.spriteOverflow), MACHINE_FIELD(ppuStatus.spriteZeroHit),
+    MACHINE_FIELD(ppuStatus.inVblank),
+    MACHINE_FIELD(coarseX), MACHINE_FIELD(slicePalette), MACHINE_FIELD(renderTable),
+    MACHINE_FIELD(sliceQueue0), MACHINE_FIELD(sliceQueue1), MACHINE_FIELD(sliceQueueSize),
+    MACHINE_FIELD(gamepadShiftRegister1), MACHINE_FIELD(gamepadShiftRegister2),
+    MACHINE_FIELD(mapper.mirroring), MACHINE_FIELD(mapper.bank), MACHINE_FIELD(mapper.control),
+    MACHINE_FIELD(mapper.shift), MACHINE_FIELD(mapper.shiftCount), MACHINE_FIELD(mapper.irqLatch),
+    MACHINE_FIELD(mapper.irqCounter), MACHINE_FIELD(mapper.irqReload),
+    MACHINE_FIELD(mapper.irqEnabled), MACHINE_FIELD(mapper.irq),
+    MACHINE_FIELD(ram), MACHINE_FIELD(vram), MACHINE_FIELD(palette), MACHINE_FIELD(oam),
+    MACHINE_FIELD(prgRam), MACHINE_FIELD(chrRam),
+    MACHINE_FIELD(apu)
+};
+
+#define DIFF_MAX_BYTES 8 // per array, the rest are counted
+
+// print each field where got isn't what was expected in want
+void diffMachines(const struct Machine *want, const struct Machine *got){
+    const unsigned char *a = (const unsigned char *)want;
+    const unsigned char *b = (const unsigned char *)got;
+
+    for(int i = 0; i < (int)(sizeof machineFields / sizeof machineFields[0]); i++){
+        const struct MachineField *f = &machineFields[i];
+        const unsigned char *x = a + f->offset;
+        const unsigned char *y = b + f->offset;
+        if(memcmp(x, y, f->size) == 0) continue;
+
+        if(f->offset == offsetof(struct Machine, apu)){
+            const char *last = NULL;
+            for(int j = 0; j < f->size; j++){
+                const char *name = apuFieldAt(j);
+                if(x[j] == y[j] || name == NULL || name == last) continue;
+                printf("  apu.%s\n", name);
+                last = name;
+            }
+        }
+        else if(f->size == sizeof(int)){
+            int u, v;
+            memcpy(&u, x, sizeof u);
+            memcpy(&v, y, sizeof v);
+            printf("  %s: %d, recorded %d\n", f->name, v, u);
+        }
+        else if(f->size == 1){
+            printf("  %s: $%02x, recorded $%02x\n", f->name, y[0], x[0]);
+        }
+        else{
+            int shown = 0;
+            int more = 0;
+            for(int j = 0; j < f->size; j++){
+                if(x[j] == y[j]) continue;
+                if(shown == DIFF_MAX_BYTES){ more++; continue; }
+                printf("  %s[$%03x]: $%02x, recorded $%02x\n", f->name, j, y[j], x[j]);
+                shown++;
+            }
+            if(more) printf("  %s: %d more bytes differ\n", f->name, more);
+        }
+    }
+}
+
+int movieVerify = 0; // --verify, explain a divergence in detail
+int movieDiverged = -1; // first frame the replay didn't match, -1 = none yet
+int movieDiffShown = 0;
+
+// the machine is at the start of a frame of the movie. Check it against
+// the recording (or note it down) and take a keyframe if one is due.
+// Keyframes taken here all start exactly on a frame. Frames run ahead
+// aren't part of the movie, they're skipped.
+void movieFrame(){
+    struct Movie *m = console->movie;
+    if(console->speculative) return;
+    unsigned long long hash = apuHash(xxh64(nes, offsetof(struct Machine, apu), 0));
+
+    if(!movieCheckHash(m, nes->frameNo, hash) && movieDiverged < 0){
+        movieDiverged = nes->frameNo;
+        printf("movie: replay diverged, frame %d didn't start the way it did when recorded\n", nes->frameNo);
+    }
+
+    if(movieKeyDue(m, nes->frameNo)){
+        snapshotMachine(movieSnap);
+        movieAddKey(m, nes->frameNo, movieSnap);
+    }
+
+    // the first keyframe on a frame start at or after the divergence says
+    // what went wrong
+    if(movieVerify && movieDiverged >= 0 && !movieDiffShown){
+        if(movieFindKey(m, nes->frameNo, movieSnap) != nes->frameNo) return;
+        const struct Machine *want = (const struct Machine *)movieSnap;
+        if(want->dot != 0 || want->scanline != 0) return;
+        printf("differences at frame %d:\n", nes->frameNo);
+        diffMachines(want, nes);
+        movieDiffShown = 1;
+    }
 }
 
-void getBlob(FILE * file, unsigned char * ptr, size_t n){
-    int numRead = fread(ptr, 1, n, file);
-    if(numRead < n){
-        printf("getBlob n=%zu failed: %s\n", n, strerror(errno));
+// go to the start of frame in the movie, by way of the keyframe before it.
+// The frames in between run without drawing or sound.
+void seekMovie(int frame){
+    struct Movie *m = console->movie;
+    if(m == NULL) return;
+
+    if(frame < movieStart(m)) frame = movieStart(m);
+    if(frame > movieEnd(m)) frame = movieEnd(m);
+
+    if(movieFindKey(m, frame, movieSnap) < 0) return;
+    restoreMachine(movieSnap);
+
+    // only the last frame before the one we want needs drawing
+    unsigned char *screen = console->screen;
+    console->screen = NULL;
+    while(nes->frameNo < frame){
+        if(nes->frameNo == frame - 1) console->screen = screen;
+        int start = nes->frameNo;
+        while(nes->frameNo == start) stepPPU();
+        synthSkip();
+    }
+    console->screen = screen;
+    rewindLastFrame = nes->frameNo;
+}
+
+// a save was loaded while recording, what was recorded up to now doesn't
+// lead to it. Start over from here.
+void restartMovie(){
+    struct Movie *m = console->movie;
+    if(m == NULL || moviePlaying(m)) return;
+    freeMovie(m);
+    console->movie = newMovie(machineSnapshotSize(), movieKeyInterval, nes->frameNo);
+    if(console->movie == NULL){
+        printf("movie: out of memory\n");
         exit(1);
     }
+    snapshotMachine(movieSnap);
+    movieAddKey(console->movie, nes->frameNo, movieSnap);
+    printf("recording %s again from frame %d\n", moviePath, nes->frameNo);
+}
+
+// start what --record, --play and --seek asked for. Returns 0 if the
+// movie to play can't be loaded.
+int openMovie(){
+    if(playPath){
+        if(!startPlayback(playPath)) return 0;
+        if(seekFrame >= 0) seekMovie(seekFrame);
+    }
+    else if(recordPath){
+        startRecording(recordPath);
+    }
+    return 1;
 }
 
+// write out the movie being recorded, or let go of the one being played
+void finishMovie(){
+    struct Movie *m = console->movie;
+    if(m == NULL) return;
+    if(!moviePlaying(m)){
+        saveMovie(m, moviePath, romCrc());
+        printf("recorded frames %d to %d\n", movieStart(m), movieEnd(m));
+    }
+    freeMovie(m);
+    console->movie = NULL;
+}
+
+// the file is written in the background, see savefile.c
 void save(){
     char filename[16];
 
     sprintf(filename, "save%d", saveSlot);
 
-    FILE * file = openSaveFileForWriting(APP_NAME, filename);
-
-    if(file == NULL) return;
-
-    putInt(file, frameNo);
-    putInt(file, scanline);
-    putInt(file, dot);
-    putInt(file, cpuDots);
-    putInt(file, triplet);
-    putInt(file, nmiComing);
-    putInt(file, nmiHappening);
-    putInt(file, vectors.nmi);
-    putInt(file, vectors.reset);
-    putInt(file, vectors.irq);
-    putInt(file, regs.A);
-    putInt(file, regs.X);
-    putInt(file, regs.Y);
-    putInt(file, regs.S);
-    putInt(file, regs.PC);
-    putInt(file, regs.P.carry);
-    putInt(file, regs.P.zero);
-    putInt(file, regs.P.interruptDisable);
-    putInt(file, regs.P.decimal);
-    putInt(file, regs.P.overflow);
-    putInt(file, regs.P.negative);
-    putBlob(file, memory, 0x1000);
-    putBlob(file, ppuMemory+0x2000, 0x2000);
-    putBlob(file, oam, 256);
-    putInt(file, ppuAddr);
-    putInt(file, oamAddr);
-    putInt(file, ppuT);
-    putInt(file, ppuX);
-    putInt(file, ppuScrollX);
-    putInt(file, ppuScrollY);
-    putInt(file, ppuNameBase);
-    putInt(file, ppuFineX);
-    putInt(file, ppuDataReadBuffer);
-    putInt(file, gamepadShiftRegister1);
-    putInt(file, gamepadShiftRegister2);
-    putInt(file, coarseX);
-    for(int i = 0; i < 4; i++){
-        putInt(file, slicePalette[i].r);
-        putInt(file, slicePalette[i].g);
-        putInt(file, slicePalette[i].b);
+    unsigned char *snap = malloc(machineSnapshotSize());
+    if(snap == NULL){
+        printf("save: out of memory\n");
+        return;
     }
-    putInt(file, renderBase);
-    putInt(file, sliceQueue0);
-    putInt(file, sliceQueue1);
-    putInt(file, sliceQueueSize);
 
-    printf("saved to %s\n", filename);
+    snapshotMachine(snap);
+    writeSaveFile(APP_NAME, filename, snap, machineSnapshotSize(), romCrc());
 
-    fclose(file);
+    free(snap);
 }
 
 void load(){
@@ -2216,70 +3426,600 @@ void load(){
 
     sprintf(filename, "save%d", saveSlot);
 
-    FILE * file = openSaveFileForReading(APP_NAME, filename);
-
-    if(file == NULL) return;
-
-    frameNo = getInt(file);
-    scanline = getInt(file);
-    dot = getInt(file);
-    cpuDots = getInt(file);
-    triplet = getInt(file);
-    nmiComing = getInt(file);
-    nmiHappening = getInt(file);
-    vectors.nmi = getInt(file);
-    vectors.reset = getInt(file);
-    vectors.irq = getInt(file);
-    regs.A = getInt(file);
-    regs.X = getInt(file);
-    regs.Y = getInt(file);
-    regs.S = getInt(file);
-    regs.PC = getInt(file);
-    regs.P.carry = getInt(file);
-    regs.P.zero = getInt(file);
-    regs.P.interruptDisable = getInt(file);
-    regs.P.decimal = getInt(file);
-    regs.P.overflow = getInt(file);
-    regs.P.negative = getInt(file);
-    getBlob(file, memory, 0x1000);
-    getBlob(file, ppuMemory+0x2000, 0x2000);
-    getBlob(file, oam, 256);
-    ppuAddr = getInt(file);
-    oamAddr = getInt(file);
-    ppuT = getInt(file);
-    ppuX = getInt(file);
-    ppuScrollX = getInt(file);
-    ppuScrollY = getInt(file);
-    ppuNameBase = getInt(file);
-    ppuFineX = getInt(file);
-    ppuDataReadBuffer = getInt(file);
-    gamepadShiftRegister1 = getInt(file);
-    gamepadShiftRegister2 = getInt(file);
-    coarseX = getInt(file);
+    // a save still on its way to disk has to land before we read it
+    flushSaveFiles();
 
-    for(int i = 0; i < 4; i++){
-        slicePalette[i].r = getInt(file);
-        slicePalette[i].g = getInt(file);
-        slicePalette[i].b = getInt(file);
+    unsigned char *snap = malloc(machineSnapshotSize());
+    if(snap == NULL){
+        printf("load: out of memory\n");
+        return;
+    }
+
+    if(readSaveFile(APP_NAME, filename, snap, machineSnapshotSize(), romCrc())){
+        if(restoreMachine(snap)){
+            printf("loaded from %s\n", filename);
+            restartMovie();
+        }
+        else printf("%s is from a different version, not loaded\n", filename);
+    }
+
+    free(snap);
+
+}
+
+/* fast start
+A run normally starts at power on, and the game spends its first couple
+of seconds warming up before anything happens. --fast-start skips that
+by starting from a snapshot taken BOOT_FRAMES in, made the first time
+and kept in the stash dir for the rom (romhash.boot, a save file). --start
+starts from any save file in the stash dir instead, a save slot like
+save1 or one written with --save-as, "World 1-1 start" say.
+
+Either way the rom header and cpu aren't printed.
+*/
+#define BOOT_FRAMES 120
+
+int fastStart = 0; // --fast-start
+const char *startName = NULL; // --start
+const char *saveAsName = NULL; // --save-as
+unsigned char *bootSnap = NULL; // what every console starts from, NULL for power on
+
+// read the snapshot in save file name into bootSnap. Returns 0 with a
+// message if it isn't there or can't be used.
+int readBootSnap(const char *name){
+    if(!saveFileExists(APP_NAME, name)){
+        printf("no snapshot called %s\n", name);
+        return 0;
+    }
+    if(!readSaveFile(APP_NAME, name, bootSnap, machineSnapshotSize(), romCrc())) return 0;
+
+    const struct Machine *m = (const struct Machine *)bootSnap;
+    if(m->version != MACHINE_VERSION || m->size != (int)sizeof(struct Machine)){
+        printf("%s is from a different version\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+// work out bootSnap for --fast-start or --start, on the selected console.
+// Returns 0 if the snapshot asked for can't be had.
+int prepareBoot(){
+    if(!fastStart && startName == NULL) return 1;
+
+    bootSnap = malloc(machineSnapshotSize());
+    if(bootSnap == NULL){
+        printf("out of memory\n");
+        return 0;
+    }
+
+    if(startName) return readBootSnap(startName);
+
+    char name[32];
+    sprintf(name, "%016llx.boot", romHash);
+    if(saveFileExists(APP_NAME, name) && readBootSnap(name)) return 1;
+
+    // first time for this rom, boot it for real and keep the result
+    unsigned char *screen = console->screen;
+    console->screen = NULL;
+    powerOn();
+    resetCPU();
+    for(int f = 0; f < BOOT_FRAMES; f++){
+        for(int i = 0; i < 262 * 341; i++) stepPPU();
+        synthSkip();
+    }
+    console->screen = screen;
+
+    snapshotMachine(bootSnap);
+    writeSaveFile(APP_NAME, name, bootSnap, machineSnapshotSize(), romCrc());
+    printf("fast start: booted %d frames, saved as %s\n", BOOT_FRAMES, name);
+    return 1;
+}
+
+// the selected console's machine from bootSnap, or from power on
+void bootMachine(){
+    powerOn();
+    resetCPU();
+    if(bootSnap) restoreMachine(bootSnap);
+}
+
+// --save-as, keep the machine as it is now for --start
+void saveAs(){
+    if(saveAsName == NULL) return;
+    unsigned char *snap = malloc(machineSnapshotSize());
+    if(snap == NULL){
+        printf("save: out of memory\n");
+        return;
+    }
+    snapshotMachine(snap);
+    writeSaveFile(APP_NAME, saveAsName, snap, machineSnapshotSize(), romCrc());
+    printf("saved frame %d as %s\n", nes->frameNo, saveAsName);
+    free(snap);
+}
+
+
+void usage(){
+    printf("usage: mario [options]\n");
+    printf("  --rom FILE      the .nes file to play (default rom.nes)\n");
+    printf("  --fast-start    skip the game's boot, from a snapshot kept for the rom\n");
+    printf("  --start NAME    start from the snapshot saved as NAME, a save slot\n");
+    printf("                  (save1 ...) or one written with --save-as\n");
+    printf("  --save-as NAME  headless: save the machine as NAME when done\n");
+    printf("  --headless      no window or audio device, run as fast as possible\n");
+    printf("  --frames N      number of frames to run headless (default 600,\n");
+    printf("                  or to the end of the movie being played)\n");
+    printf("  --wav FILE      headless: write audio to a 32 bit float WAV file\n");
+    printf("  --raw FILE      headless: write audio as raw 32 bit floats\n");
+    printf("  --rate HZ       headless: audio sample rate (default 44100)\n");
+    printf("  --rewind N      keep rewind history every N frames, 0 = off\n");
+    printf("                  (default 1, off when headless)\n");
+    printf("  --record FILE   record the controllers to a movie\n");
+    printf("  --play FILE     play a movie back\n");
+    printf("  --seek N        start playing the movie at frame N\n");
+    printf("  --keyframes N   frames between snapshots in a recorded movie (default 600)\n");
+    printf("  --verify FILE   headless: play a movie and report where it stops matching\n");
+    printf("  --runahead N    show N frames ahead to hide the game's input lag\n");
+    printf("  --pace-audio    pace frames by the audio device instead of the clock\n");
+    printf("  --consoles N    headless: run N separate consoles side by side\n");
+    printf("  --threads N     threads to run consoles on (default one per core)\n");
+    printf("  --batch N       frames each console runs per batch (default 60)\n");
+    printf("  --scaling       time the consoles on 1, 2, 4 ... threads\n");
+}
+
+double elapsedSeconds(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// from the start of main to the end of the first frame
+struct timespec processStart;
+int coldStartReported = 0;
+
+void reportColdStart(){
+    if(coldStartReported) return;
+    coldStartReported = 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("cold start: %.2fms to the first frame, rom cache %s\n", elapsedSeconds(&processStart, &now) * 1e3, romCacheState);
+}
+
+/* run-ahead
+A game reacts to a button a frame or two after it reads it. To hide that,
+each host frame emulates the real frame without drawing it, snapshots,
+runs runAhead more frames with the same input and shows the last one,
+then goes back to the snapshot. Only the real frame makes sound.
+
+The extra frames are speculative, they're kept out of a movie being
+recorded or played. Recording, they'd record input for frames that
+haven't really happened yet. Playing, they get the movie's input but
+don't count as played, and they don't start at the same place in the
+apu's timeline as the real frames do, so they aren't checked against
+the recording and don't take keyframes.
+*/
+#define RUN_AHEAD_MAX 4
+int runAhead = 0; // extra frames, 0 = off
+unsigned char *runAheadSnap = NULL;
+double runAheadCost = 0.0; // seconds per host frame, smoothed
+double runAheadMaxCost = 0.0;
+
+void runFrameAhead(){
+    struct timespec start, end;
+
+    if(runAheadSnap == NULL){
+        runAheadSnap = malloc(machineSnapshotSize());
+        if(runAheadSnap == NULL){
+            printf("run-ahead: out of memory\n");
+            exit(1);
+        }
+    }
+
+    unsigned char *screen = console->screen;
+    console->screen = NULL;
+    for(int i = 0; i < 262 * 341; i++) stepPPU();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    snapshotChanges(runAheadSnap, TRACK_RUNAHEAD);
+
+    console->speculative = 1;
+    for(int f = 0; f < runAhead; f++){
+        if(f == runAhead - 1) console->screen = screen;
+        for(int i = 0; i < 262 * 341; i++) stepPPU();
+        synthSkip();
+    }
+    console->speculative = 0;
+
+    console->screen = screen;
+    restoreChanges(runAheadSnap, TRACK_RUNAHEAD);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double cost = elapsedSeconds(&start, &end);
+    runAheadCost = runAheadCost * 0.95 + cost * 0.05;
+    if(cost > runAheadMaxCost) runAheadMaxCost = cost;
+}
+
+void setRunAhead(int n){
+    runAhead = n;
+    runAheadCost = 0.0;
+    runAheadMaxCost = 0.0;
+    printf("run-ahead %d\n", n);
+}
+
+/* fast-forward
+Key 6 runs as many frames per host frame as fit in FAST_FORWARD_BUDGET of
+it, 1 to 5 go back to a normal speed. Only the last frame of each batch
+is drawn, the rest run without a screen like run-ahead's. The batch size
+comes from what the frames of the last batch cost, so it follows the
+machine and the game (busy scenes cost more). The sound would come out
+several times too fast, it's muted.
+*/
+#define FAST_FORWARD_BUDGET 0.75 // of a host frame
+#define FAST_FORWARD_MAX 1000 // frames per host frame
+int fastForward = 0;
+double fastForwardCost = 0.0; // seconds per frame, smoothed
+int fastForwardFrames = 0; // in the last batch
+long long fastForwardLast = 0; // when the last batch started
+double fastForwardSpeed = 0.0; // times real time, smoothed
+
+void runFastForward(){
+    int n = 1;
+    if(fastForwardCost > 0.0) n = FAST_FORWARD_BUDGET * NTSC_FRAME_NS / 1e9 / fastForwardCost;
+    if(n < 1) n = 1;
+    if(n > FAST_FORWARD_MAX) n = FAST_FORWARD_MAX;
+
+    long long start = monotonicNs();
+    if(fastForwardLast){
+        double speed = (double)fastForwardFrames * NTSC_FRAME_NS / (start - fastForwardLast);
+        fastForwardSpeed = fastForwardSpeed == 0.0 ? speed : fastForwardSpeed * 0.9 + speed * 0.1;
+    }
+    fastForwardLast = start;
+
+    unsigned char *screen = console->screen;
+    console->screen = NULL;
+    for(int f = 0; f < n; f++){
+        if(f == n - 1) console->screen = screen;
+        for(int i = 0; i < 262 * 341; i++) stepPPU();
+        synthSkip();
+        recordRewind();
+    }
+    console->screen = screen;
+
+    double cost = (monotonicNs() - start) / 1e9 / n;
+    fastForwardCost = fastForwardCost == 0.0 ? cost : fastForwardCost * 0.8 + cost * 0.2;
+    fastForwardFrames = n;
+}
+
+void setFastForward(int on){
+    if(on == fastForward) return;
+    fastForward = on;
+    fastForwardCost = 0.0;
+    fastForwardFrames = 0;
+    fastForwardLast = 0;
+    fastForwardSpeed = 0.0;
+    printf("fast-forward %s\n", on ? "on" : "off");
+}
+
+// no window and no audio device, emulate numFrames as fast as possible.
+// If audioPath is given, everything synth produces goes to that file,
+// otherwise the apu runs with audio off.
+int runHeadless(int numFrames, const char *audioPath, int wav, int rate){
+    float samples[4096];
+    struct timespec start, end;
+
+    setSampleRate(rate);
+    if(audioPath && !openAudioSink(audioPath, wav, rate)) return 1;
+
+    if(!readRom(romPath)) return 1;
+    if(!prepareBoot()) return 1;
+    bootMachine();
+    startRewind();
+
+    screenImg = GenImageColor(screenW,screenH,BLUE);
+    mainConsole.screen = screenImg.data;
+
+    if(!openMovie()) return 1;
+
+    // a movie plays to the end unless told otherwise
+    if(numFrames < 0){
+        numFrames = playPath ? movieEnd(console->movie) - nes->frameNo : 600;
     }
 
-    renderBase = getInt(file);
-    sliceQueue0 = getInt(file);
-    sliceQueue1 = getInt(file);
-    sliceQueueSize = getInt(file);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(int f = 0; f < numFrames; f++){
+        if(runAhead > 0){
+            runFrameAhead();
+        }
+        else{
+            for(int i = 0; i < 262 * 341; i++){
+                stepPPU();
+            }
+        }
+
+        recordRewind();
+        countDirtyPages();
+        reportColdStart();
+
+        if(audioPath == NULL){
+            synthSkip();
+            continue;
+        }
+
+        int n = apuSamplesPending();
+        while(n > 0){
+            int chunk = n < 4096 ? n : 4096;
+            synth(samples, chunk);
+            writeAudioSink(samples, chunk);
+            n -= chunk;
+        }
+    }
 
-    printf("loaded from %s\n", filename);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    closeAudioSink();
+
+    double seconds = elapsedSeconds(&start, &end);
+    double emulated = numFrames / 60.0988;
+    printf(
+        "%d frames in %.3fs (%.1fx real time)\n",
+        numFrames, seconds, seconds > 0 ? emulated / seconds : 0.0
+    );
+    if(rewindSnap){
+        printf(
+            "rewind: %d snapshots in %ldK, %.1fus per snapshot (max %.1fus)\n",
+            rewindFrames(), rewindBytes() / 1024, rewindAveragePush() * 1e6, rewindMaxPush * 1e6
+        );
+    }
+
+    if(runAhead){
+        printf(
+            "run-ahead: %d frames, %.2fms per frame (max %.2fms)\n",
+            runAhead, runAheadCost * 1e3, runAheadMaxCost * 1e3
+        );
+    }
+
+    printf(
+        "dirty pages: %.1f of %d per frame, %d more always copied (%d bytes each)\n",
+        dirtyFrames ? (double)dirtyTotal / dirtyFrames : 0.0, pagesTracked,
+        MACHINE_PAGES - pagesTracked, DIRTY_PAGE_SIZE
+    );
+
+    finishMovie();
+    saveAs();
+    flushSaveFiles();
+
+    if(movieVerify){
+        if(movieDiverged < 0){
+            printf("verified: the replay matches the recording\n");
+            return 0;
+        }
+        printf("first divergence at frame %d\n", movieDiverged);
+        if(!movieDiffShown) printf("no keyframe after it to compare with, record with --keyframes 1 to see what differs\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// run every console numFrames frames on numThreads threads, batchFrames
+// at a time (see batch.c). numFrames is a multiple of batchFrames.
+// Returns frames per second over all consoles, 0 if the threads couldn't
+// be started.
+double timeBatch(struct Console **consoles, int numConsoles, int numThreads, int numFrames, int batchFrames, long *steals){
+    struct timespec start, end;
+
+    struct Batch *b = createBatch(consoles, numConsoles, numThreads, batchFrames);
+    if(b == NULL) return 0.0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int f = 0; f < numFrames; f += batchFrames) runBatch(b);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *steals = batchSteals(b);
+    destroyBatch(b);
+
+    double seconds = elapsedSeconds(&start, &end);
+    return seconds > 0 ? (double)numConsoles * numFrames / seconds : 0.0;
+}
+
+// headless with numConsoles independent consoles on a thread pool, all
+// with audio off. With scaling, time it on 1, 2, 4 ... numThreads threads.
+int runConsoles(int numConsoles, int numFrames, int numThreads, int batchFrames, int scaling){
+    if(!readRom(romPath)) return 1;
+    if(!prepareBoot()) return 1;
+
+    struct Console **consoles = malloc(numConsoles * sizeof(struct Console *));
+    if(consoles == NULL){
+        printf("out of memory\n");
+        return 1;
+    }
+    for(int i = 0; i < numConsoles; i++){
+        consoles[i] = createConsole(0);
+        if(consoles[i] == NULL){
+            printf("out of memory after %d consoles\n", i);
+            return 1;
+        }
+        bootMachine();
+    }
+    printf(
+        "%d consoles, %d bytes each, %.1fM in all\n",
+        numConsoles, (int)sizeof(struct Console), (double)numConsoles * sizeof(struct Console) / (1 << 20)
+    );
+
+    // whole batches only
+    if(batchFrames > numFrames) batchFrames = numFrames;
+    numFrames = (numFrames + batchFrames - 1) / batchFrames * batchFrames;
+
+    long steals;
+    if(scaling){
+        printf("%d consoles, %d frames, %d frames per batch\n", numConsoles, numFrames, batchFrames);
+        printf("threads   frames/s  speedup  efficiency  steals\n");
+        double base = 0.0;
+        for(int t = 1; ; t = t * 2 < numThreads ? t * 2 : numThreads){
+            double fps = timeBatch(consoles, numConsoles, t, numFrames, batchFrames, &steals);
+            if(fps == 0.0){
+                printf("can't start %d threads\n", t);
+                break;
+            }
+            if(t == 1) base = fps;
+            printf(
+                "%7d %10.0f %8.2f %10.0f%% %7ld\n",
+                t, fps, fps / base, 100.0 * fps / base / t, steals
+            );
+            if(t == numThreads) break;
+        }
+    }
+    else{
+        double fps = timeBatch(consoles, numConsoles, numThreads, numFrames, batchFrames, &steals);
+        if(fps == 0.0){
+            printf("can't start %d threads\n", numThreads);
+        }
+        else{
+            printf(
+                "%d consoles x %d frames on %d threads, %.0f frames/s (%.1fx real time each), %ld steals\n",
+                numConsoles, numFrames, numThreads, fps, fps / numConsoles / 60.0988, steals
+            );
+        }
+    }
 
-    fclose(file);
+    for(int i = 0; i < numConsoles; i++) destroyConsole(consoles[i]);
+    free(consoles);
 
+    return 0;
 }
 
+int main(int argc, char *argv[]){
+    clock_gettime(CLOCK_MONOTONIC, &processStart);
+    initOpcodeTable();
+
+    int headless = 0;
+    int numFrames = -1;
+    const char *audioPath = NULL;
+    int wav = 1;
+    int rate = 44100;
+    int rewindGiven = 0;
+    int numConsoles = 0;
+    int numThreads = batchCores();
+    int batchFrames = 60;
+    int scaling = 0;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--headless") == 0){
+            headless = 1;
+        }
+        else if(strcmp(argv[i], "--rom") == 0 && i + 1 < argc){
+            romPath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--fast-start") == 0){
+            fastStart = 1;
+        }
+        else if(strcmp(argv[i], "--start") == 0 && i + 1 < argc){
+            startName = argv[++i];
+        }
+        else if(strcmp(argv[i], "--save-as") == 0 && i + 1 < argc){
+            saveAsName = argv[++i];
+        }
+        else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc){
+            numFrames = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--wav") == 0 && i + 1 < argc){
+            audioPath = argv[++i];
+            wav = 1;
+        }
+        else if(strcmp(argv[i], "--raw") == 0 && i + 1 < argc){
+            audioPath = argv[++i];
+            wav = 0;
+        }
+        else if(strcmp(argv[i], "--rate") == 0 && i + 1 < argc){
+            rate = atoi(argv[++i]);
+            if(rate < 8000 || rate > 192000){
+                printf("sample rate %d out of range\n", rate);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--consoles") == 0 && i + 1 < argc){
+            numConsoles = atoi(argv[++i]);
+            if(numConsoles < 1){
+                printf("--consoles needs at least 1\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            numThreads = atoi(argv[++i]);
+            if(numThreads < 1){
+                printf("--threads needs at least 1\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc){
+            batchFrames = atoi(argv[++i]);
+            if(batchFrames < 1){
+                printf("--batch needs at least 1 frame\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--scaling") == 0){
+            scaling = 1;
+        }
+        else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+            recordPath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--play") == 0 && i + 1 < argc){
+            playPath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--verify") == 0 && i + 1 < argc){
+            playPath = argv[++i];
+            movieVerify = 1;
+            headless = 1;
+        }
+        else if(strcmp(argv[i], "--seek") == 0 && i + 1 < argc){
+            seekFrame = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--keyframes") == 0 && i + 1 < argc){
+            movieKeyInterval = atoi(argv[++i]);
+            if(movieKeyInterval < 1){
+                printf("--keyframes needs at least 1\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--runahead") == 0 && i + 1 < argc){
+            runAhead = atoi(argv[++i]);
+            if(runAhead < 0 || runAhead > RUN_AHEAD_MAX){
+                printf("--runahead is 0 to %d frames\n", RUN_AHEAD_MAX);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--pace-audio") == 0){
+            paceAudio = 1;
+        }
+        else if(strcmp(argv[i], "--rewind") == 0 && i + 1 < argc){
+            rewindEvery = atoi(argv[++i]);
+            rewindGiven = 1;
+        }
+        else{
+            usage();
+            return 1;
+        }
+    }
 
-int main(){
+    if(headless && !rewindGiven) rewindEvery = 0;
 
-    int e = pthread_mutex_init(&audio_mutex, NULL);
-    if(e != 0){
-        printf("mutex init failed\n");
+    if(scaling) headless = 1;
+
+    if(fastStart || startName) verbose = 0;
+
+    if(!numConsoles && !headless && !readRom(romPath)) return 1;
+
+    if(numConsoles && (!headless || audioPath)){
+        printf("--consoles only works with --headless and no audio output\n");
+        return 1;
+    }
+
+    if(scaling && !numConsoles) numConsoles = 4 * numThreads;
+    if(numConsoles && numFrames < 0) numFrames = 600;
+    if(numConsoles) return runConsoles(numConsoles, numFrames, numThreads, batchFrames, scaling);
+    if(headless) return runHeadless(numFrames, audioPath, wav, rate);
+
+    if(audioPath){
+        printf("--wav and --raw only work with --headless\n");
         return 1;
     }
 
@@ -2289,19 +4029,27 @@ int main(){
         exit(1);
     }
 
+    // small device periods, otherwise a 20ms ring can't keep up
+    SetAudioStreamBufferSizeDefault(512);
     AudioStream stream = LoadAudioStream(44100, 16, 1);
     SetAudioStreamCallback(stream, AudioCb);
     PlayAudioStream(stream);
 
-    readRom();
-    resetCPU();
-    showCPU();
+    if(!prepareBoot()) return 1;
+    bootMachine();
+    if(verbose) showCPU();
+    startRewind();
 
     InitWindow(screenW * screenScale, screenH * screenScale, "mario");
-    SetTargetFPS(60);
 
     screenImg = GenImageColor(screenW,screenH,BLUE);
     screenTex = LoadTextureFromImage(screenImg);
+    mainConsole.screen = screenImg.data;
+
+    if(!openMovie()){
+        CloseWindow();
+        return 1;
+    }
 
     // screenImg.format probably = R8G8B8A8
     printf("screenImg.width   = %d\n", screenImg.width);
@@ -2322,24 +4070,37 @@ int main(){
     SetGamepadMappings("03000000790000004e95000011010000,DragonRise Inc. NGC USB Gamepad,a:b1,b:b0,dpdown:b14,dpleft:b15,dpright:b13,dpup:b12,leftshoulder:b4,lefttrigger:a3,leftx:a0,lefty:a1~,rightshoulder:b5,righttrigger:a4,rightx:a5,righty:a2~,start:b9,x:b2,y:b3,platform:Linux,");
 
 
-    while(!WindowShouldClose()) {
+    // the audio device plays this while synth follows the cpu
+    generateSilence(AUDIO_TARGET);
 
-        while(audio_buffer_amount < 4000){
-            generate(256);
-        }
+    unsigned lastUnderruns = 0;
+    unsigned lastOverruns = 0;
+
+    while(!WindowShouldClose()) {
 
         pollGamepad();
 
-        if(stepFlag){
+        int rewinding = IsKeyDown(KEY_BACKSPACE);
+
+        if(rewinding){
+            stepBackward();
+        }
+        else if(stepFlag){
             while(stepPPU()==0);
             stepFlag = 0;
         }
         else if(skipToNMI){
-            while(nmiHappening == 0) stepPPU();
+            while(nes->nmiHappening == 0) stepPPU();
             skipToNMI = 0;
             timeFreeze = 1;
             timeDilation = 200000;
         }
+        else if(fastForward && !timeFreeze && !skipToRTS){
+            runFastForward();
+        }
+        else if(runAhead > 0 && timeDilation == 1 && !timeFreeze && !skipToRTS){
+            runFrameAhead();
+        }
         else{
             // 1 frame is 262 lines, each line is 341 dots.
             // if the next CPU instruction would take N cycles
@@ -2359,7 +4120,7 @@ int main(){
                 //if(regs.PC == 0x93fc){ timeFreeze = 1; break; }
                 //if(regs.PC == 0x8082){ timeFreeze = 1; break; }
                 //if(regs.PC == 0x8227){ timeFreeze = 1; break; }
-                if(skipToRTS && memory[regs.PC] == 0x60){
+                if(skipToRTS && peekMemory(nes->regs.PC) == 0x60){
                     skipToRTS = 0;
                     timeFreeze = 1;
                     timeDilation = 200000;
@@ -2368,21 +4129,62 @@ int main(){
             }
         }
 
-        if(IsKeyPressed(KEY_FIVE)){ timeDilation = 1; }
-        if(IsKeyPressed(KEY_FOUR)){ timeDilation = 10; }
-        if(IsKeyPressed(KEY_THREE)){ timeDilation = 1000; }
-        if(IsKeyPressed(KEY_TWO)){ timeDilation = 5000; }
-        if(IsKeyPressed(KEY_ONE)){ timeDilation = 200000; }
+        if(!rewinding){
+            recordRewind();
+        }
+        countDirtyPages();
+        reportColdStart();
+
+        // synthesize up to where the cpu is now, in one batch. If the
+        // cpu is barely moving (slow motion, freeze) run synth a bit ahead.
+        // With audio off nothing is listening, so there's no reason to run
+        // ahead and the apu just keeps up with the cpu. Going backwards
+        // there's nothing to play, keep the device fed with silence.
+        // Fast-forward is muted the same way.
+        if(rewinding || fastForward){
+            if(!rewinding) synthSkip();
+            unsigned fill = audioBufferAmount();
+            if(fill < AUDIO_TARGET) generateSilence(AUDIO_TARGET - fill);
+        }
+        else if(audioOff){
+            synthSkip();
+        }
+        else{
+            generate(apuSamplesPending());
+            while(audioBufferAmount() < AUDIO_TARGET / 2){
+                generate(64);
+            }
+        }
+
+        unsigned underruns = atomic_load(&audio_underruns);
+        if(underruns != lastUnderruns || audio_overruns != lastOverruns){
+            printf("audio underruns = %u overruns = %u\n", underruns, audio_overruns);
+            lastUnderruns = underruns;
+            lastOverruns = audio_overruns;
+        }
+
+        if(IsKeyPressed(KEY_SIX)){ timeDilation = 1; setFastForward(1); }
+        if(IsKeyPressed(KEY_FIVE)){ timeDilation = 1; setFastForward(0); }
+        if(IsKeyPressed(KEY_FOUR)){ timeDilation = 10; setFastForward(0); }
+        if(IsKeyPressed(KEY_THREE)){ timeDilation = 1000; setFastForward(0); }
+        if(IsKeyPressed(KEY_TWO)){ timeDilation = 5000; setFastForward(0); }
+        if(IsKeyPressed(KEY_ONE)){ timeDilation = 200000; setFastForward(0); }
         if(IsKeyPressed(KEY_F1)){ showMemory = !showMemory; showDebug = !showDebug; }
         if(IsKeyPressed(KEY_F2)){ showVisual = !showVisual; }
         if(IsKeyPressed(KEY_F3)){ showPalettes = !showPalettes; }
         if(IsKeyPressed(KEY_F4)){ showNametables = !showNametables; }
         if(IsKeyPressed(KEY_F12)){ TakeScreenshot("screenshot.png"); }
 
+        if(console->movie && moviePlaying(console->movie)){
+            if(IsKeyPressed(KEY_PAGE_UP)){ seekMovie(nes->frameNo - 600); }
+            if(IsKeyPressed(KEY_PAGE_DOWN)){ seekMovie(nes->frameNo + 600); }
+        }
+
         if(IsKeyPressed(KEY_F5)){ save(); }
         if(IsKeyPressed(KEY_F8)){ load(); }
 
-        if(IsKeyPressed(KEY_TAB)){ silence = !silence; }
+        if(IsKeyPressed(KEY_TAB)){ toggleAudio(); }
+        if(IsKeyPressed(KEY_F6)){ setRunAhead((runAhead + 1) % (RUN_AHEAD_MAX + 1)); }
         if(IsKeyPressed(KEY_N)){ skipToNMI = 1; }
         if(IsKeyPressed(KEY_R)){ skipToRTS = 1; timeDilation = 1; }
         if(IsKeyPressed(KEY_F)){ timeFreeze = !timeFreeze; }
@@ -2433,20 +4235,21 @@ int main(){
         for(int j = 0; j < 48; j++){
             if(j%4 == 0) drawByte(0, j, j/4);
             for(int i = 0; i < 64; i++){
-                int level = memory[j*64 + i];
+                int level = peekMemory(j*64 + i);
                 drawByte(i+1, j, level);
             }
         }
 
-        for(int i = 0xff; i > regs.S; i--){
-            drawByte(320*3/14 - 1, 240*3/12 - 1 - (0xff - i), memory[0x0100 + i]);
+        for(int i = 0xff; i > nes->regs.S; i--){
+            drawByte(320*3/14 - 1, 240*3/12 - 1 - (0xff - i), nes->ram[0x0100 + i]);
         }
 
-        DrawText("1 = turtle slow", 2, 240*3 - 12*7, 10, WHITE);
-        DrawText("2 = turtle slow+", 2, 240*3 - 12*6, 10, WHITE);
-        DrawText("3 = fast", 2, 240*3 - 12*5, 10, WHITE);
-        DrawText("4 = blazing", 2, 240*3 - 12*4, 10, WHITE);
-        DrawText("5 = ludicrous", 2, 240*3 - 12*3, 10, WHITE);
+        DrawText("1 = turtle slow", 2, 240*3 - 12*8, 10, WHITE);
+        DrawText("2 = turtle slow+", 2, 240*3 - 12*7, 10, WHITE);
+        DrawText("3 = fast", 2, 240*3 - 12*6, 10, WHITE);
+        DrawText("4 = blazing", 2, 240*3 - 12*5, 10, WHITE);
+        DrawText("5 = ludicrous", 2, 240*3 - 12*4, 10, WHITE);
+        DrawText("6 = plaid", 2, 240*3 - 12*3, 10, WHITE);
 
         DrawText("F1: hide/show cpu memory", 100, 240*3 - 12*10, 10, WHITE);
         DrawText("F2: hide/show visual", 100, 240*3 - 12*9, 10, WHITE);
@@ -2456,8 +4259,58 @@ int main(){
         DrawText("Enter: exec 1 instruction", 100, 240*3 - 12*5, 10, WHITE);
         DrawText("R: skip to RTS and freeze", 100, 240*3 - 12*4, 10, WHITE);
         DrawText("N: skip to NMI and freeze", 100, 240*3 - 12*3, 10, WHITE);
-
-        DrawText(TextFormat("frameNo = %d",frameNo), 2, 240*3 - 16, 10, WHITE);
+        DrawText("Backspace: rewind", 100, 240*3 - 12*2, 10, WHITE);
+        DrawText("PgUp/PgDn: seek movie 10s", 300, 240*3 - 12*2, 10, WHITE);
+        DrawText("F6: run-ahead 0-4 frames", 300, 240*3 - 12*3, 10, WHITE);
+
+        DrawText(TextFormat("frameNo = %d",nes->frameNo), 2, 240*3 - 16, 10, WHITE);
+        DrawText(
+            TextFormat(
+                "audio fill = %u ratio = %.4f underruns = %u overruns = %u",
+                audioBufferAmount(), resampleRatio, lastUnderruns, lastOverruns
+            ),
+            100, 240*3 - 16, 10, WHITE
+        );
+        DrawText(
+            TextFormat(
+                "rewind = %d frames %ldK, %.0fus avg %.0fus max",
+                rewindFrames(), rewindBytes() / 1024, rewindAveragePush() * 1e6, rewindMaxPush * 1e6
+            ),
+            100, 240*3 - 12*11, 10, rewindLastPush > REWIND_BUDGET ? RED : WHITE
+        );
+        if(runAhead){
+            DrawText(
+                TextFormat(
+                    "run-ahead = %d frames, %.2fms per frame (%.2fms each) max %.2fms",
+                    runAhead, runAheadCost * 1e3, runAheadCost * 1e3 / runAhead, runAheadMaxCost * 1e3
+                ),
+                100, 240*3 - 12*13, 10, WHITE
+            );
+        }
+        DrawText(
+            TextFormat(
+                "frame time p50 = %.2fms p99 = %.2fms (%.2fms target%s)",
+                frameTimeP50 * 1e3, frameTimeP99 * 1e3, NTSC_FRAME_NS / 1e6, paceAudio ? ", audio paced" : ""
+            ),
+            100, 240*3 - 12*15, 10, frameTimeP99 * 1e9 > NTSC_FRAME_NS + PACE_SPIN_NS ? RED : WHITE
+        );
+        DrawText(
+            TextFormat(
+                "dirty pages = %d of %d this frame, %.1f avg, last snapshot %d pages",
+                dirtyLastFrame, pagesTracked, dirtyFrames ? (double)dirtyTotal / dirtyFrames : 0.0, lastSnapshotPages
+            ),
+            100, 240*3 - 12*14, 10, WHITE
+        );
+        if(console->movie){
+            DrawText(
+                TextFormat(
+                    "movie %s frame %d of %d to %d",
+                    moviePlaying(console->movie) ? "playing" : "recording",
+                    nes->frameNo, movieStart(console->movie), movieEnd(console->movie)
+                ),
+                100, 240*3 - 12*12, 10, WHITE
+            );
+        }
 
         }
 
@@ -2465,22 +4318,22 @@ int main(){
         if(showNametables){
         int per = 61;
         for(int i = 0; i < 0x400; i++){
-            unsigned char l = per * ppuMemory[0x2000 + i];
+            unsigned char l = per * nes->vram[i];
             Color c = {l,l,l,255};
             DrawRectangle(100 + 12*(i%32), 200 + 12*(i/32), 12, 12, c);
         }
 
         for(int i = 0; i < 0x400; i++){
-            unsigned char l = per * ppuMemory[0x2400 + i];
+            unsigned char l = per * nes->vram[0x400 + i];
             Color c = {l,l,l,255};
             DrawRectangle(500 + 12*(i%32), 200 + 12*(i/32), 12, 12, c);
         }
 
-        DrawRectangleLines(100 + 3*ppuScrollX/2, 200, 32*12, 32*12, GREEN);
+        DrawRectangleLines(100 + 3*nes->ppuScrollX/2, 200, 32*12, 32*12, GREEN);
 
         for(int s = 0; s <= 15; s++){
-            int x = oam[s*4 + 3];
-            int y = oam[s*4 + 0];
+            int x = nes->oam[s*4 + 3];
+            int y = nes->oam[s*4 + 0];
             DrawRing((Vector2){100 + 8 + 3*x/2, 200 + 8 + 3*y/2}, 6, 8, 0, 360, 24, GOLD);
         }
 
@@ -2490,10 +4343,10 @@ int main(){
             DrawTextureEx(screenTex, (Vector2){96,0}, 0.0f, 3, WHITE);
 
             if(showMemory){
-                DrawRing((Vector2){96 + 3*dot + 4, 4 + 3*(scanline - 1)}, 6, 8, 0, 360, 24, BLUE);
+                DrawRing((Vector2){96 + 3*nes->dot + 4, 4 + 3*(nes->scanline - 1)}, 6, 8, 0, 360, 24, BLUE);
                 for(int s = 0; s < 64; s++){
-                    int x = oam[s*4 + 3];
-                    int y = oam[s*4 + 0];
+                    int x = nes->oam[s*4 + 3];
+                    int y = nes->oam[s*4 + 0];
                     DrawRectangleLines(96 + 3*x, 3*y, 3*8, 3*8, RED);
                 }
             }
@@ -2502,32 +4355,39 @@ int main(){
         if(showPalettes)
             drawPalettes();
 
+        if(fastForward){
+            DrawText(
+                TextFormat(">> %.1fx (%d frames)", fastForwardSpeed, fastForwardFrames),
+                96 + 8, 8, 20, YELLOW
+            );
+        }
+
         // SprObject_X_Pos    $86
         // SprObject_X_Speed  $57
         // Player_XSpeedAbsolute $700
 
         if(showDebug){
-        DrawText(TextFormat("Player_PageLoc = %u", memory[0x6d]), 2, 100+2*20, 20, WHITE);
-        DrawText(TextFormat("Player X Pos = %u", memory[0x86]), 2, 100+3*20, 20, WHITE);
+        DrawText(TextFormat("Player_PageLoc = %u", nes->ram[0x6d]), 2, 100+2*20, 20, WHITE);
+        DrawText(TextFormat("Player X Pos = %u", nes->ram[0x86]), 2, 100+3*20, 20, WHITE);
 
-        DrawText(TextFormat("Player_X_MoveForce = %u", memory[0x705]), 2, 100+4*20, 20, WHITE);
+        DrawText(TextFormat("Player_X_MoveForce = %u", nes->ram[0x705]), 2, 100+4*20, 20, WHITE);
 
-        DrawText(TextFormat("Player X Spd = %d", UNCOMPLEMENT(memory[0x57])), 2, 100+5*20, 20, WHITE);
+        DrawText(TextFormat("Player X Spd = %d", UNCOMPLEMENT(nes->ram[0x57])), 2, 100+5*20, 20, WHITE);
 
-        unsigned char fricHigh = memory[0x701];
-        unsigned char fricLow = memory[0x702];
+        unsigned char fricHigh = nes->ram[0x701];
+        unsigned char fricLow = nes->ram[0x702];
         double fric = fricHigh + (fricLow / 256.0);
         DrawText(TextFormat("frict = %lf", fric), 2, 100+6*20, 20, WHITE);
 
-        DrawText(TextFormat("FrictionAdderHigh = %u", memory[0x701]), 2, 100+7*20, 20, WHITE);
-        DrawText(TextFormat("FrictionAdderLow = %u", memory[0x702]), 2, 100+8*20, 20, WHITE);
+        DrawText(TextFormat("FrictionAdderHigh = %u", nes->ram[0x701]), 2, 100+7*20, 20, WHITE);
+        DrawText(TextFormat("FrictionAdderLow = %u", nes->ram[0x702]), 2, 100+8*20, 20, WHITE);
 
-        DrawText(TextFormat("Player_X_Scroll = %d", UNCOMPLEMENT(memory[0x6ff])), 2, 100+9*20, 20, WHITE);
+        DrawText(TextFormat("Player_X_Scroll = %d", UNCOMPLEMENT(nes->ram[0x6ff])), 2, 100+9*20, 20, WHITE);
 
 
-        DrawText(TextFormat("MaxLeftSpeed = %d", UNCOMPLEMENT(memory[0x450])), 2, 100+10*20, 20, WHITE);
-        DrawText(TextFormat("MaxRightSpeed = %u", memory[0x456]), 2, 100+11*20, 20, WHITE);
-        DrawText(TextFormat("RunningTimer = %u", memory[0x783]), 2, 100+12*20, 20, WHITE);
+        DrawText(TextFormat("MaxLeftSpeed = %d", UNCOMPLEMENT(nes->ram[0x450])), 2, 100+10*20, 20, WHITE);
+        DrawText(TextFormat("MaxRightSpeed = %u", nes->ram[0x456]), 2, 100+11*20, 20, WHITE);
+        DrawText(TextFormat("RunningTimer = %u", nes->ram[0x783]), 2, 100+12*20, 20, WHITE);
 
         DrawText(TextFormat("Gamepad1 = %d", IsGamepadAvailable(0)), 2, 100+13*20, 20, WHITE);
         DrawText(TextFormat("Gamepad2 = %d", IsGamepadAvailable(1)), 2, 100+14*20, 20, WHITE);
@@ -2535,11 +4395,13 @@ int main(){
 
         EndDrawing();
 
+        paceFrame();
     }
 
-    pthread_mutex_destroy(&audio_mutex);
     UnloadAudioStream(stream);
     CloseAudioDevice();
+    finishMovie();
+    flushSaveFiles();
     CloseWindow(); 
 
     return 0;
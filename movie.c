@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* input movies
+A movie is the buttons held on both controllers for every frame of a
+run, plus snapshots of the machine (keyframes) every so often. The first
+keyframe is where the movie starts, playing it back is restoring that and
+feeding the same buttons in again. Seeking restores the nearest keyframe
+before the frame you want and runs from there.
+
+Input is taken when the game strobes the controllers ($4016). The first
+strobe in a frame decides that frame's buttons, later strobes in the
+same frame get the same ones, so the recording is exactly what the game
+saw. A frame the game never strobed in repeats the one before.
+
+Frames are numbered by the machine's frameNo, which keyframes restore
+along with everything else.
+
+Every frame also gets a fingerprint, an xxh64 of the machine as the
+frame begins (hash.c), all but the apu's synth fields (apu.c).
+Playing back, the machine is checked against them to catch the first
+frame where the replay stops matching what was recorded, a frame
+earlier than anything would show up on screen.
+
+On disk it's a save file (savefile.c) with magic "MARIOMOV" and sections
+  MOVI  start frame, frames, keyframe interval, keyframes, snapshot size
+  INPT  2 bytes per frame, controller 1 and 2 packed like packGamepad
+  KEYF  for each keyframe its frame number (4 bytes) then the snapshot
+  HASH  8 bytes per frame from the start frame on, 0 = not known
+  ROM   crc of the PRG and CHR ROM it was recorded with
+*/
+
+#define MOVIE_HEADER_SIZE 20
+
+struct SaveImage;
+extern struct SaveImage * newSaveImage(const char *magic);
+extern void addSection(struct SaveImage *image, const char *id, int compress, const unsigned char *data, long length);
+extern void queueSaveImage(struct SaveImage *image, const char *appname, const char *filename);
+extern unsigned char * readSaveImage(const char *appname, const char *filename, const char *magic, size_t *size);
+extern long sectionLength(const unsigned char *image, const char *id);
+extern int readSection(const unsigned char *image, size_t size, const char *id, unsigned char *out, long length);
+extern void put32LE(unsigned char *buf, long n);
+extern unsigned long get32LE(const unsigned char *buf);
+
+struct Movie {
+    int playing; // else recording
+    int ended; // played past the last frame
+    int snapSize;
+    int keyInterval;
+    int start; // frame number of the first frame
+
+    unsigned char *input; // 2 bytes per frame
+    int frames;
+    int inputCapacity;
+
+    unsigned char *keys; // 4 byte frame number + snapshot, each
+    int numKeys;
+    int keyCapacity;
+
+    unsigned char *hashes; // 8 bytes per frame, little endian
+    int numHashes;
+    int hashCapacity;
+};
+
+struct Movie * newMovie(int snapSize, int keyInterval, int start){
+    struct Movie *m = calloc(1, sizeof(struct Movie));
+    if(m == NULL) return NULL;
+    m->snapSize = snapSize;
+    m->keyInterval = keyInterval;
+    m->start = start;
+    return m;
+}
+
+void freeMovie(struct Movie *m){
+    if(m == NULL) return;
+    free(m->input);
+    free(m->keys);
+    free(m->hashes);
+    free(m);
+}
+
+int keyStride(struct Movie *m){
+    return 4 + m->snapSize;
+}
+
+int keyFrame(struct Movie *m, int k){
+    return get32LE(m->keys + k * keyStride(m));
+}
+
+// make room in buf for need things of unit bytes each
+int grow(unsigned char **buf, int *have, int need, int unit){
+    if(need <= *have) return 1;
+    int capacity = *have ? *have : 64;
+    while(capacity < need) capacity *= 2;
+    unsigned char *bigger = realloc(*buf, (size_t)capacity * unit);
+    if(bigger == NULL){
+        fprintf(stderr, "movie: out of memory\n");
+        return 0;
+    }
+    *buf = bigger;
+    *have = capacity;
+    return 1;
+}
+
+// replace pad1 and pad2 with what was recorded for frame, without
+// recording anything. Returns 0 and leaves them if the movie doesn't
+// have that frame.
+int movieInput(struct Movie *m, int frame, unsigned char *pad1, unsigned char *pad2){
+    int i = frame - m->start;
+    if(i < 0 || i >= m->frames) return 0;
+    *pad1 = m->input[2*i];
+    *pad2 = m->input[2*i + 1];
+    return 1;
+}
+
+// the game strobed the controllers during frame. Recording, pad1 and pad2
+// are what's held and get recorded, unless this frame already was.
+// Playing, they're replaced with the recorded ones.
+void movieLatch(struct Movie *m, int frame, unsigned char *pad1, unsigned char *pad2){
+    int i = frame - m->start;
+    if(i < 0) return;
+
+    if(movieInput(m, frame, pad1, pad2)) return;
+
+    if(m->playing){
+        if(!m->ended) printf("movie ended at frame %d\n", frame);
+        m->ended = 1;
+        return;
+    }
+
+    if(!grow(&m->input, &m->inputCapacity, i + 1, 2)) return;
+
+    // frames nobody strobed in hold what was held before
+    for(int j = m->frames; j < i; j++){
+        m->input[2*j] = j > 0 ? m->input[2*j - 2] : 0;
+        m->input[2*j + 1] = j > 0 ? m->input[2*j - 1] : 0;
+    }
+    m->input[2*i] = *pad1;
+    m->input[2*i + 1] = *pad2;
+    m->frames = i + 1;
+}
+
+// recording, is it time for a keyframe at frame
+int movieKeyDue(struct Movie *m, int frame){
+    if(m->playing) return 0;
+    if(m->numKeys == 0) return 1;
+    return frame - keyFrame(m, m->numKeys - 1) >= m->keyInterval;
+}
+
+void movieAddKey(struct Movie *m, int frame, const unsigned char *snap){
+    if(!grow(&m->keys, &m->keyCapacity, m->numKeys + 1, keyStride(m))) return;
+    unsigned char *p = m->keys + m->numKeys * keyStride(m);
+    put32LE(p, frame);
+    memcpy(p + 4, snap, m->snapSize);
+    m->numKeys++;
+}
+
+// copy the last keyframe at or before frame into snap and return its
+// frame number, or -1 if there isn't one
+int movieFindKey(struct Movie *m, int frame, unsigned char *snap){
+    for(int k = m->numKeys - 1; k >= 0; k--){
+        if(keyFrame(m, k) <= frame){
+            memcpy(snap, m->keys + k * keyStride(m) + 4, m->snapSize);
+            return keyFrame(m, k);
+        }
+    }
+    return -1;
+}
+
+void put64LE(unsigned char *buf, unsigned long long n){
+    for(int i = 0; i < 8; i++) buf[i] = n >> (8 * i);
+}
+
+unsigned long long get64LE(const unsigned char *buf){
+    unsigned long long n = 0;
+    for(int i = 7; i >= 0; i--) n = (n << 8) | buf[i];
+    return n;
+}
+
+// the machine hashed to hash as frame began. Recording, that's noted.
+// Playing, returns 0 if it isn't what was recorded.
+int movieCheckHash(struct Movie *m, int frame, unsigned long long hash){
+    int i = frame - m->start;
+    if(i < 0) return 1;
+
+    if(m->playing){
+        if(i >= m->numHashes) return 1;
+        unsigned long long want = get64LE(m->hashes + 8*i);
+        return want == 0 || want == hash;
+    }
+
+    if(!grow(&m->hashes, &m->hashCapacity, i + 1, 8)) return 1;
+    for(int j = m->numHashes; j < i; j++) put64LE(m->hashes + 8*j, 0);
+    put64LE(m->hashes + 8*i, hash);
+    m->numHashes = i + 1;
+    return 1;
+}
+
+// recording, the machine went back to frame (rewind). Forget everything
+// from there on, it's about to be recorded again.
+void movieTruncate(struct Movie *m, int frame){
+    if(m->playing) return;
+    int i = frame - m->start;
+    if(i < 0) i = 0;
+    if(i < m->frames) m->frames = i;
+    if(i + 1 < m->numHashes) m->numHashes = i + 1;
+    while(m->numKeys > 1 && keyFrame(m, m->numKeys - 1) > frame) m->numKeys--;
+}
+
+int movieStart(struct Movie *m){
+    return m->start;
+}
+
+// one past the last recorded frame
+int movieEnd(struct Movie *m){
+    return m->start + m->frames;
+}
+
+int moviePlaying(struct Movie *m){
+    return m->playing;
+}
+
+// queue the movie to be written to path
+void saveMovie(struct Movie *m, const char *path, unsigned long romCrc){
+    unsigned char header[MOVIE_HEADER_SIZE];
+    put32LE(header, m->start);
+    put32LE(header + 4, m->frames);
+    put32LE(header + 8, m->keyInterval);
+    put32LE(header + 12, m->numKeys);
+    put32LE(header + 16, m->snapSize);
+
+    unsigned char rom[4];
+    put32LE(rom, romCrc);
+
+    struct SaveImage *image = newSaveImage("MARIOMOV");
+    addSection(image, "MOVI", 0, header, MOVIE_HEADER_SIZE);
+    addSection(image, "INPT", 1, m->input, 2L * m->frames);
+    addSection(image, "KEYF", 1, m->keys, (long)m->numKeys * keyStride(m));
+    addSection(image, "HASH", 0, m->hashes, 8L * m->numHashes);
+    addSection(image, "ROM ", 0, rom, 4);
+    queueSaveImage(image, NULL, path);
+}
+
+// read a movie for playback. Returns NULL with a message if the file is
+// bad, for another rom or has snapshots of another size.
+struct Movie * loadMovie(const char *path, int snapSize, unsigned long romCrc){
+    size_t size;
+    unsigned char *image = readSaveImage(NULL, path, "MARIOMOV", &size);
+    if(image == NULL) return NULL;
+
+    const char *problem = NULL;
+    long hashBytes = sectionLength(image, "HASH"); // older movies have none
+    unsigned char header[MOVIE_HEADER_SIZE];
+    unsigned char rom[4];
+    struct Movie *m = NULL;
+
+    if(!readSection(image, size, "MOVI", header, MOVIE_HEADER_SIZE) || !readSection(image, size, "ROM ", rom, 4)){
+        problem = "damaged or truncated";
+    }
+    else if(get32LE(rom) != romCrc){
+        problem = "recorded with a different rom";
+    }
+    else if(get32LE(header + 16) != (unsigned long)snapSize){
+        problem = "recorded by another version";
+    }
+    else if(
+        sectionLength(image, "INPT") != 2L * get32LE(header + 4) ||
+        sectionLength(image, "KEYF") != (long)get32LE(header + 12) * (4 + snapSize) ||
+        get32LE(header + 12) == 0 ||
+        (hashBytes > 0 && hashBytes % 8 != 0)
+    ){
+        problem = "damaged";
+    }
+
+    if(problem == NULL){
+        m = newMovie(snapSize, get32LE(header + 8), get32LE(header));
+        if(m == NULL ||
+            !grow(&m->input, &m->inputCapacity, get32LE(header + 4), 2) ||
+            !grow(&m->keys, &m->keyCapacity, get32LE(header + 12), keyStride(m)) ||
+            (hashBytes > 0 && !grow(&m->hashes, &m->hashCapacity, hashBytes / 8, 8))
+        ){
+            problem = "out of memory";
+        }
+        else{
+            m->playing = 1;
+            m->frames = get32LE(header + 4);
+            m->numKeys = get32LE(header + 12);
+            m->numHashes = hashBytes > 0 ? hashBytes / 8 : 0;
+            if(
+                !readSection(image, size, "INPT", m->input, 2L * m->frames) ||
+                !readSection(image, size, "KEYF", m->keys, (long)m->numKeys * keyStride(m)) ||
+                (hashBytes > 0 && !readSection(image, size, "HASH", m->hashes, hashBytes))
+            ){
+                problem = "damaged";
+            }
+        }
+    }
+
+    free(image);
+
+    if(problem){
+        printf("%s: %s, not loaded\n", path, problem);
+        freeMovie(m);
+        return NULL;
+    }
+
+    return m;
+}
@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 
 #if defined(_WIN32)
@@ -78,13 +81,15 @@ FILE * openSaveFileForReading(const char * appname, const char * filename){
     struct stat s;
     int e = stat(buf, &s);
 
-    if(e < 0 && errno == ENOENT){
+    if(e < 0){
+        if(errno != ENOENT) fprintf(stderr, "can't read stash dir %s: %s\n", buf, strerror(errno));
         free(buf);
         return NULL;
     }
 
     if(!S_ISDIR(s.st_mode)){
         fprintf(stderr, "?_? stash path leads to non-directory file\n");
+        free(buf);
         return NULL;
     }
 
@@ -102,3 +107,119 @@ FILE * openSaveFileForReading(const char * appname, const char * filename){
 
     return file;
 }
+
+// is there a file called filename in the stash dir
+int saveFileExists(const char * appname, const char * filename){
+
+    const char * home = getenv("HOME");
+
+    if(home == NULL){
+        fprintf(stderr, "no HOME\n");
+        exit(1);
+    }
+
+    size_t baselen = strlen(home) + strlen(STASH_PATH) + strlen(appname);
+    char * buf = malloc(baselen + strlen("/") + strlen(filename) + 1);
+
+    sprintf(buf, "%s%s%s/%s", home, STASH_PATH, appname, filename);
+
+    int e = access(buf, F_OK);
+
+    free(buf);
+    return e == 0;
+}
+
+// rename from to to, both in the stash dir. Replaces to if it exists,
+// which on posix is atomic. Returns 0 on failure.
+int replaceSaveFile(const char * appname, const char * from, const char * to){
+
+    const char * home = getenv("HOME");
+
+    if(home == NULL){
+        fprintf(stderr, "no HOME\n");
+        exit(1);
+    }
+
+    size_t baselen = strlen(home) + strlen(STASH_PATH) + strlen(appname);
+
+    char * src = malloc(baselen + strlen("/") + strlen(from) + 1);
+    char * dst = malloc(baselen + strlen("/") + strlen(to) + 1);
+
+    sprintf(src, "%s%s%s/%s", home, STASH_PATH, appname, from);
+    sprintf(dst, "%s%s%s/%s", home, STASH_PATH, appname, to);
+
+    int e = rename(src, dst);
+
+    free(src);
+    free(dst);
+
+    if(e < 0){
+        fprintf(stderr, "can't replace save file: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+const unsigned char * mapFile(const char * path, size_t * size);
+
+// a file in the stash dir, mapped read only. Returns NULL if it isn't
+// there, with a message if it is and can't be mapped.
+const unsigned char * mapSaveFile(const char * appname, const char * filename, size_t * size){
+
+    const char * home = getenv("HOME");
+
+    if(home == NULL){
+        fprintf(stderr, "no HOME\n");
+        exit(1);
+    }
+
+    size_t baselen = strlen(home) + strlen(STASH_PATH) + strlen(appname);
+    char * buf = malloc(baselen + strlen("/") + strlen(filename) + 1);
+
+    sprintf(buf, "%s%s%s/%s", home, STASH_PATH, appname, filename);
+
+    const unsigned char * data = NULL;
+    if(access(buf, F_OK) == 0) data = mapFile(buf, size);
+
+    free(buf);
+    return data;
+}
+
+// the whole file at path, mapped read only. Returns NULL with a message
+// if it can't be.
+const unsigned char * mapFile(const char * path, size_t * size){
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat s;
+    if(fstat(fd, &s) < 0){
+        fprintf(stderr, "can't map %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if(s.st_size == 0){
+        fprintf(stderr, "can't map %s: empty file\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void * data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(data == MAP_FAILED){
+        fprintf(stderr, "can't map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    *size = s.st_size;
+    return data;
+}
+
+void unmapFile(const unsigned char * data, size_t size){
+    munmap((void *)data, size);
+}
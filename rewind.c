@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* rewind buffer
+a history of machine snapshots kept in memory, newest last. Every
+REWIND_KEY_INTERVAL-th entry is a keyframe, the ones after it are XOR'd
+against it. One frame of play changes a few hundred bytes of the machine,
+so a delta is almost all zeros. Every entry is then run length encoded as
+
+  zeros (2 bytes LE), literals (2 bytes LE), literal bytes
+
+repeated until the whole snapshot is covered. Keyframes get the same
+encoding as is, the raw machine has plenty of zeros in it too.
+
+Encoded entries go one after another into a fixed arena. When it's full
+the oldest keyframe and the deltas depending on it are dropped together.
+*/
+
+#define REWIND_KEY_INTERVAL 60
+#define REWIND_MAX_ENTRIES 65536 // power of two
+#define REWIND_MIN_ZEROS 4 // shorter gaps are cheaper as literals
+
+struct RewindEntry {
+    int offset; // in the arena
+    int length;
+    int key;
+};
+
+unsigned char *rewindArena = NULL;
+int rewindArenaSize = 0;
+int rewindSnapSize = 0;
+
+// entries are numbered, entry n is at rewindEntries[n % REWIND_MAX_ENTRIES]
+struct RewindEntry rewindEntries[REWIND_MAX_ENTRIES];
+long rewindFirst = 0; // oldest
+long rewindNext = 0; // one past the newest
+
+unsigned char *rewindKey = NULL; // the decoded keyframe rewindKeyEntry
+long rewindKeyEntry = -1;
+unsigned char *rewindScratch = NULL;
+
+// per push timing, in seconds
+double rewindLastPush = 0.0;
+double rewindMaxPush = 0.0;
+double rewindTotalPush = 0.0;
+long rewindPushes = 0;
+
+// arenaSize bytes of history for snapshots of snapSize bytes
+void initRewind(int snapSize, int arenaSize){
+    rewindSnapSize = snapSize;
+    rewindArenaSize = arenaSize;
+    rewindArena = malloc(arenaSize);
+    rewindKey = malloc(snapSize);
+    rewindScratch = malloc(snapSize);
+    if(rewindArena == NULL || rewindKey == NULL || rewindScratch == NULL){
+        fprintf(stderr, "rewind: out of memory\n");
+        exit(1);
+    }
+    rewindFirst = 0;
+    rewindNext = 0;
+    rewindKeyEntry = -1;
+}
+
+void put16(unsigned char *p, int n){
+    p[0] = n & 0xff;
+    p[1] = n >> 8;
+}
+
+int get16(const unsigned char *p){
+    return p[0] | (p[1] << 8);
+}
+
+// largest possible encoding. Every token but the first covers at least
+// REWIND_MIN_ZEROS zeros, which pays for its 4 byte header.
+int rleBound(int n){
+    return n + 4 + 4 * (n / 65535 + 1);
+}
+
+int rleEncode(const unsigned char *in, int n, unsigned char *out){
+    int o = 0;
+    int i = 0;
+    while(i < n){
+        int zeros = 0;
+        while(i + zeros < n && in[i + zeros] == 0 && zeros < 65535) zeros++;
+
+        // literals run until REWIND_MIN_ZEROS zeros in a row or the end
+        int start = i + zeros;
+        int j = start;
+        while(j < n && j - start < 65535){
+            if(in[j] == 0){
+                int z = 0;
+                while(j + z < n && in[j + z] == 0 && z < REWIND_MIN_ZEROS) z++;
+                if(z == REWIND_MIN_ZEROS || j + z == n) break;
+                j += z;
+            }
+            else{
+                j++;
+            }
+        }
+        if(j - start > 65535) j = start + 65535;
+
+        put16(out + o, zeros);
+        put16(out + o + 2, j - start);
+        memcpy(out + o + 4, in + start, j - start);
+        o += 4 + j - start;
+        i = j;
+    }
+    return o;
+}
+
+// decode into exactly n bytes. Returns 0 if the input is malformed or
+// doesn't come out to n bytes, which only happens with a damaged file.
+int rleDecode(const unsigned char *in, int length, unsigned char *out, int n){
+    int o = 0;
+    int i = 0;
+    while(i < length){
+        if(length - i < 4) return 0;
+        int zeros = get16(in + i);
+        int literals = get16(in + i + 2);
+        i += 4;
+        if(zeros + literals > n - o || literals > length - i) return 0;
+        memset(out + o, 0, zeros);
+        o += zeros;
+        memcpy(out + o, in + i, literals);
+        o += literals;
+        i += literals;
+    }
+    return o == n;
+}
+
+struct RewindEntry *rewindEntry(long n){
+    return &rewindEntries[n & (REWIND_MAX_ENTRIES - 1)];
+}
+
+// the keyframe entry n depends on, or -1 if it's gone
+long rewindKeyFor(long n){
+    for(; n >= rewindFirst; n--){
+        if(rewindEntry(n)->key) return n;
+    }
+    return -1;
+}
+
+// drop the oldest keyframe along with its deltas
+void rewindDropOldest(){
+    do{
+        rewindFirst++;
+    } while(rewindFirst < rewindNext && !rewindEntry(rewindFirst)->key);
+}
+
+int rewindOverlaps(struct RewindEntry *e, int offset, int length){
+    return e->offset < offset + length && offset < e->offset + e->length;
+}
+
+double rewindNow(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// add a snapshot to the history
+void rewindPush(const unsigned char *snap){
+    double start = rewindNow();
+    int need = rleBound(rewindSnapSize);
+
+    if(need > rewindArenaSize){
+        fprintf(stderr, "rewind: arena is smaller than one snapshot\n");
+        exit(1);
+    }
+
+    if(rewindNext - rewindFirst == REWIND_MAX_ENTRIES) rewindDropOldest();
+
+    // find room after the newest entry, wrapping around to the start.
+    // What's between here and the end of the arena is the oldest history.
+    int offset = 0;
+    if(rewindNext > rewindFirst){
+        struct RewindEntry *newest = rewindEntry(rewindNext - 1);
+        offset = newest->offset + newest->length;
+    }
+    if(offset + need > rewindArenaSize){
+        while(rewindFirst < rewindNext && rewindEntry(rewindFirst)->offset >= offset){
+            rewindDropOldest();
+        }
+        offset = 0;
+    }
+    while(rewindFirst < rewindNext && rewindOverlaps(rewindEntry(rewindFirst), offset, need)){
+        rewindDropOldest();
+    }
+
+    long key = rewindKeyFor(rewindNext - 1);
+    int isKey = key < 0 || key != rewindKeyEntry || rewindNext - key >= REWIND_KEY_INTERVAL;
+
+    struct RewindEntry *e = rewindEntry(rewindNext);
+    e->offset = offset;
+    e->key = isKey;
+
+    if(isKey){
+        e->length = rleEncode(snap, rewindSnapSize, rewindArena + offset);
+        memcpy(rewindKey, snap, rewindSnapSize);
+        rewindKeyEntry = rewindNext;
+    }
+    else{
+        for(int i = 0; i < rewindSnapSize; i++) rewindScratch[i] = snap[i] ^ rewindKey[i];
+        e->length = rleEncode(rewindScratch, rewindSnapSize, rewindArena + offset);
+    }
+
+    rewindNext++;
+
+    rewindLastPush = rewindNow() - start;
+    if(rewindLastPush > rewindMaxPush) rewindMaxPush = rewindLastPush;
+    rewindTotalPush += rewindLastPush;
+    rewindPushes++;
+}
+
+// take the newest snapshot off the history and put it in snap.
+// Returns 0 if there's nothing left.
+int rewindPop(unsigned char *snap){
+    if(rewindNext == rewindFirst) return 0;
+
+    long n = rewindNext - 1;
+    struct RewindEntry *e = rewindEntry(n);
+
+    if(e->key){
+        rleDecode(rewindArena + e->offset, e->length, snap, rewindSnapSize);
+    }
+    else{
+        long key = rewindKeyFor(n);
+        if(key != rewindKeyEntry){
+            struct RewindEntry *k = rewindEntry(key);
+            rleDecode(rewindArena + k->offset, k->length, rewindKey, rewindSnapSize);
+            rewindKeyEntry = key;
+        }
+        rleDecode(rewindArena + e->offset, e->length, snap, rewindSnapSize);
+        for(int i = 0; i < rewindSnapSize; i++) snap[i] ^= rewindKey[i];
+    }
+
+    rewindNext = n;
+    return 1;
+}
+
+int rewindFrames(){
+    return rewindNext - rewindFirst;
+}
+
+long rewindBytes(){
+    long total = 0;
+    for(long n = rewindFirst; n < rewindNext; n++) total += rewindEntry(n)->length;
+    return total;
+}
+
+double rewindAveragePush(){
+    return rewindPushes ? rewindTotalPush / rewindPushes : 0.0;
+}
@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* save files
+Save states, movies (movie.c) and the rom cache are all written in
+this format. A file is built in memory all at once, then handed to a
+writer thread. The writer puts it in a temp file next to the real one,
+flushes it to disk and renames it over the old save, so a crash or full
+disk in the middle never leaves a half written save behind. The main
+loop only pays for the snapshot and compression.
+
+Layout, all numbers little endian:
+
+  header       magic (8 chars), format version, section count, table crc
+  section table, one entry per section:
+               id (4 chars), compression, offset, stored length,
+               length, crc of the uncompressed data
+  section data
+
+A save state is "MARIOSAV" with sections
+  MACH  the machine snapshot, run length encoded like the rewind buffer
+  ROM   crc of the PRG and CHR ROM it was saved with
+
+The loader reads the whole file and checks the header and table, then
+each section's length and crc as it's unpacked. A save state is checked
+completely, rom included, before anyone restores the machine from it.
+
+With appname NULL, filename is a path of its own instead of a file in
+the app's stash dir.
+*/
+
+#define SAVE_FORMAT_VERSION 1
+#define SAVE_HEADER_SIZE 20
+#define SAVE_SECTION_SIZE 24
+#define SAVE_MAX_SECTIONS 16
+
+#define COMPRESS_NONE 0
+#define COMPRESS_RLE 1
+
+extern FILE * openSaveFileForWriting(const char * appname, const char * filename);
+extern FILE * openSaveFileForReading(const char * appname, const char * filename);
+extern int replaceSaveFile(const char * appname, const char * from, const char * to);
+extern const unsigned char * mapSaveFile(const char * appname, const char * filename, size_t * size);
+extern void unmapFile(const unsigned char * data, size_t size);
+
+extern void put32LE(unsigned char *buf, long n);
+extern int rleBound(int n);
+extern int rleEncode(const unsigned char *in, int n, unsigned char *out);
+extern int rleDecode(const unsigned char *in, int length, unsigned char *out, int n);
+
+unsigned long get32LE(const unsigned char *buf){
+    return
+        (unsigned long)buf[0] |
+        (unsigned long)buf[1] << 8 |
+        (unsigned long)buf[2] << 16 |
+        (unsigned long)buf[3] << 24;
+}
+
+// CRC-32 (the zip / png one)
+unsigned long crcTable[256];
+int crcTableReady = 0;
+
+unsigned long crc32Update(unsigned long crc, const unsigned char *data, size_t n){
+    if(!crcTableReady){
+        for(int i = 0; i < 256; i++){
+            unsigned long c = i;
+            for(int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+            crcTable[i] = c;
+        }
+        crcTableReady = 1;
+    }
+
+    crc = ~crc & 0xffffffffUL;
+    for(size_t i = 0; i < n; i++) crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc & 0xffffffffUL;
+}
+
+
+
+/* writer thread */
+
+struct SaveJob {
+    char appname[32]; // empty for a plain path
+    char filename[1024];
+    unsigned char *data;
+    size_t size;
+    struct SaveJob *next; // in savePending
+};
+
+pthread_mutex_t saveMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t saveCond = PTHREAD_COND_INITIALIZER;
+pthread_t saveThread;
+int saveThreadRunning = 0;
+int saveBusy = 0; // the writer is on a job right now
+struct SaveJob *savePending = NULL; // waiting for the writer, oldest first
+
+FILE * openForWriting(const char *appname, const char *filename){
+    if(appname && appname[0]) return openSaveFileForWriting(appname, filename);
+
+    FILE *file = fopen(filename, "wb");
+    if(file == NULL) fprintf(stderr, "can't open %s: %s\n", filename, strerror(errno));
+    return file;
+}
+
+FILE * openForReading(const char *appname, const char *filename){
+    if(appname && appname[0]) return openSaveFileForReading(appname, filename);
+
+    FILE *file = fopen(filename, "rb");
+    if(file == NULL) fprintf(stderr, "can't open %s: %s\n", filename, strerror(errno));
+    return file;
+}
+
+int replaceFile(const char *appname, const char *from, const char *to){
+    if(appname[0]) return replaceSaveFile(appname, from, to);
+
+    if(rename(from, to) < 0){
+        fprintf(stderr, "can't replace %s: %s\n", to, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+void writeSaveJob(struct SaveJob *job){
+    char tmpname[sizeof job->filename + 4];
+    sprintf(tmpname, "%s.tmp", job->filename);
+
+    FILE *file = openForWriting(job->appname, tmpname);
+    if(file == NULL) return;
+
+    int ok = fwrite(job->data, 1, job->size, file) == job->size;
+    ok = fflush(file) == 0 && ok;
+#ifndef _WIN32
+    ok = fsync(fileno(file)) == 0 && ok;
+#endif
+    if(!ok) fprintf(stderr, "writing %s failed: %s\n", tmpname, strerror(errno));
+    if(fclose(file) != 0) ok = 0;
+
+    if(ok && replaceFile(job->appname, tmpname, job->filename)){
+        printf("saved to %s\n", job->filename);
+    }
+}
+
+void * saveWriter(void *arg){
+    pthread_mutex_lock(&saveMutex);
+    for(;;){
+        while(savePending == NULL) pthread_cond_wait(&saveCond, &saveMutex);
+
+        struct SaveJob *job = savePending;
+        savePending = job->next;
+        saveBusy = 1;
+        pthread_mutex_unlock(&saveMutex);
+
+        writeSaveJob(job);
+        free(job->data);
+        free(job);
+
+        pthread_mutex_lock(&saveMutex);
+        saveBusy = 0;
+        pthread_cond_broadcast(&saveCond);
+    }
+    return NULL;
+}
+
+// hand a finished image to the writer, which takes ownership of data
+void queueSaveJob(struct SaveJob *job){
+    pthread_mutex_lock(&saveMutex);
+
+    if(!saveThreadRunning){
+        if(pthread_create(&saveThread, NULL, saveWriter, NULL) != 0){
+            pthread_mutex_unlock(&saveMutex);
+            fprintf(stderr, "can't start save writer thread, saving in the foreground\n");
+            writeSaveJob(job);
+            free(job->data);
+            free(job);
+            return;
+        }
+        pthread_detach(saveThread);
+        saveThreadRunning = 1;
+    }
+
+    // an older save of the same file nobody has started writing yet is
+    // out of date, the new one takes its place in line
+    job->next = NULL;
+    struct SaveJob **link = &savePending;
+    while(*link){
+        struct SaveJob *old = *link;
+        if(strcmp(old->appname, job->appname) == 0 && strcmp(old->filename, job->filename) == 0){
+            job->next = old->next;
+            free(old->data);
+            free(old);
+            break;
+        }
+        link = &old->next;
+    }
+    *link = job;
+    pthread_cond_broadcast(&saveCond);
+    pthread_mutex_unlock(&saveMutex);
+}
+
+// wait until everything queued is on disk, call before exiting
+void flushSaveFiles(){
+    pthread_mutex_lock(&saveMutex);
+    while(savePending || saveBusy) pthread_cond_wait(&saveCond, &saveMutex);
+    pthread_mutex_unlock(&saveMutex);
+}
+
+
+
+/* building and checking images */
+
+struct SaveSection {
+    char id[4];
+    int compression;
+    long offset; // in data
+    long stored;
+    long length;
+    unsigned long crc;
+};
+
+struct SaveImage {
+    char magic[8];
+    struct SaveSection sections[SAVE_MAX_SECTIONS];
+    int count;
+    unsigned char *data; // the sections one after another, as stored
+    long size;
+    long capacity;
+    int failed; // out of memory somewhere along the way
+};
+
+struct SaveImage * newSaveImage(const char *magic){
+    struct SaveImage *image = calloc(1, sizeof(struct SaveImage));
+    if(image == NULL) return NULL;
+    memcpy(image->magic, magic, 8);
+    return image;
+}
+
+void freeSaveImage(struct SaveImage *image){
+    if(image == NULL) return;
+    free(image->data);
+    free(image);
+}
+
+// append a section of length bytes, run length encoded if compress is
+// set. The data is copied.
+void addSection(struct SaveImage *image, const char *id, int compress, const unsigned char *data, long length){
+    if(image == NULL || image->failed) return;
+
+    if(image->count == SAVE_MAX_SECTIONS){
+        fprintf(stderr, "save: too many sections\n");
+        image->failed = 1;
+        return;
+    }
+
+    long need = image->size + (compress ? rleBound(length) : length);
+    if(need > image->capacity){
+        long capacity = image->capacity ? image->capacity : 4096;
+        while(capacity < need) capacity *= 2;
+        unsigned char *bigger = realloc(image->data, capacity);
+        if(bigger == NULL){
+            image->failed = 1;
+            return;
+        }
+        image->data = bigger;
+        image->capacity = capacity;
+    }
+
+    struct SaveSection *s = &image->sections[image->count++];
+    memcpy(s->id, id, 4);
+    s->compression = compress ? COMPRESS_RLE : COMPRESS_NONE;
+    s->offset = image->size;
+    s->length = length;
+    s->crc = crc32Update(0, data, length);
+
+    if(compress){
+        s->stored = rleEncode(data, length, image->data + image->size);
+    }
+    else{
+        memcpy(image->data + image->size, data, length);
+        s->stored = length;
+    }
+    image->size += s->stored;
+}
+
+// lay out the file and queue it to be written. The image is used up.
+void queueSaveImage(struct SaveImage *image, const char *appname, const char *filename){
+    if(image == NULL || image->failed){
+        fprintf(stderr, "save: out of memory, %s not written\n", filename);
+        freeSaveImage(image);
+        return;
+    }
+
+    long start = SAVE_HEADER_SIZE + image->count * SAVE_SECTION_SIZE;
+    struct SaveJob *job = malloc(sizeof(struct SaveJob));
+    unsigned char *file = malloc(start + image->size);
+    if(job == NULL || file == NULL){
+        fprintf(stderr, "save: out of memory, %s not written\n", filename);
+        free(job);
+        free(file);
+        freeSaveImage(image);
+        return;
+    }
+
+    unsigned char *table = file + SAVE_HEADER_SIZE;
+    for(int i = 0; i < image->count; i++){
+        struct SaveSection *s = &image->sections[i];
+        unsigned char *p = table + i * SAVE_SECTION_SIZE;
+        memcpy(p, s->id, 4);
+        put32LE(p + 4, s->compression);
+        put32LE(p + 8, start + s->offset);
+        put32LE(p + 12, s->stored);
+        put32LE(p + 16, s->length);
+        put32LE(p + 20, s->crc);
+    }
+    memcpy(file + start, image->data, image->size);
+
+    memcpy(file, image->magic, 8);
+    put32LE(file + 8, SAVE_FORMAT_VERSION);
+    put32LE(file + 12, image->count);
+    put32LE(file + 16, crc32Update(0, table, image->count * SAVE_SECTION_SIZE));
+
+    snprintf(job->appname, sizeof job->appname, "%s", appname ? appname : "");
+    snprintf(job->filename, sizeof job->filename, "%s", filename);
+    job->data = file;
+    job->size = start + image->size;
+    queueSaveJob(job);
+
+    freeSaveImage(image);
+}
+
+// read a whole file into memory
+unsigned char * slurp(FILE *file, size_t *size){
+    size_t capacity = 1 << 16;
+    size_t n = 0;
+    unsigned char *buf = malloc(capacity);
+
+    while(buf){
+        n += fread(buf + n, 1, capacity - n, file);
+        if(n < capacity) break;
+        capacity *= 2;
+        unsigned char *bigger = realloc(buf, capacity);
+        if(bigger == NULL) free(buf);
+        buf = bigger;
+    }
+
+    if(buf && ferror(file)){
+        free(buf);
+        return NULL;
+    }
+
+    *size = n;
+    return buf;
+}
+
+// what's wrong with the header and section table of a file, or NULL
+const char * checkSaveImage(const unsigned char *image, size_t size, const char *magic){
+    unsigned long count = size >= SAVE_HEADER_SIZE ? get32LE(image + 12) : 0;
+
+    if(size < SAVE_HEADER_SIZE || memcmp(image, magic, 8) != 0){
+        return "wrong kind of file";
+    }
+    if(get32LE(image + 8) != SAVE_FORMAT_VERSION){
+        return "different save format version";
+    }
+    if(count > SAVE_MAX_SECTIONS || size < SAVE_HEADER_SIZE + count * SAVE_SECTION_SIZE){
+        return "truncated";
+    }
+    if(crc32Update(0, image + SAVE_HEADER_SIZE, count * SAVE_SECTION_SIZE) != get32LE(image + 16)){
+        return "section table is damaged";
+    }
+    return NULL;
+}
+
+// read a file and check its header and section table. Returns the whole
+// file for readSection, or NULL with a message. Free it when done.
+unsigned char * readSaveImage(const char *appname, const char *filename, const char *magic, size_t *size){
+    FILE *file = openForReading(appname, filename);
+    if(file == NULL) return NULL;
+
+    unsigned char *image = slurp(file, size);
+    fclose(file);
+    if(image == NULL){
+        printf("%s: can't read it\n", filename);
+        return NULL;
+    }
+
+    const char *problem = checkSaveImage(image, *size, magic);
+    if(problem){
+        printf("%s: %s, not loaded\n", filename, problem);
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+const unsigned char * findSection(const unsigned char *image, const char *id){
+    int count = get32LE(image + 12);
+    for(int i = 0; i < count; i++){
+        const unsigned char *p = image + SAVE_HEADER_SIZE + i * SAVE_SECTION_SIZE;
+        if(memcmp(p, id, 4) == 0) return p;
+    }
+    return NULL;
+}
+
+// uncompressed length of a section in a checked image, -1 if it's missing
+long sectionLength(const unsigned char *image, const char *id){
+    const unsigned char *p = findSection(image, id);
+    return p ? (long)get32LE(p + 16) : -1;
+}
+
+// unpack a section of a checked image into out, which must be exactly
+// length bytes. Returns 0 if the section is missing or bad.
+int readSection(const unsigned char *image, size_t size, const char *id, unsigned char *out, long length){
+    const unsigned char *p = findSection(image, id);
+    if(p == NULL) return 0;
+
+    unsigned long compression = get32LE(p + 4);
+    unsigned long offset = get32LE(p + 8);
+    unsigned long stored = get32LE(p + 12);
+    unsigned long raw = get32LE(p + 16);
+    unsigned long crc = get32LE(p + 20);
+
+    if(raw != (unsigned long)length) return 0;
+    if(offset > size || stored > size - offset) return 0;
+
+    if(compression == COMPRESS_RLE){
+        if(!rleDecode(image + offset, stored, out, length)) return 0;
+    }
+    else if(compression == COMPRESS_NONE){
+        if(stored != raw) return 0;
+        memcpy(out, image + offset, length);
+    }
+    else return 0;
+
+    return crc32Update(0, out, length) == crc;
+}
+
+// an uncompressed section of a checked image in place, without checking
+// its crc. NULL if it's missing, compressed or not exactly length bytes.
+const unsigned char * sectionData(const unsigned char *image, size_t size, const char *id, long length){
+    const unsigned char *p = findSection(image, id);
+    if(p == NULL) return NULL;
+
+    unsigned long offset = get32LE(p + 8);
+    unsigned long stored = get32LE(p + 12);
+
+    if(get32LE(p + 4) != COMPRESS_NONE || get32LE(p + 16) != (unsigned long)length) return NULL;
+    if(stored != (unsigned long)length || offset > size || stored > size - offset) return NULL;
+    return image + offset;
+}
+
+
+
+/* save states */
+
+// serialize a machine snapshot and queue it to be written. The snapshot
+// is copied, the caller can reuse it right away.
+void writeSaveFile(const char *appname, const char *filename, const unsigned char *machine, int machineSize, unsigned long romCrc){
+    unsigned char rom[4];
+    put32LE(rom, romCrc);
+
+    struct SaveImage *image = newSaveImage("MARIOSAV");
+    addSection(image, "MACH", 1, machine, machineSize);
+    addSection(image, "ROM ", 0, rom, 4);
+    queueSaveImage(image, appname, filename);
+}
+
+// load a machine snapshot of machineSize bytes from a save file into
+// machine. Returns 0 with a message if the file is missing, damaged, from
+// another format or another rom. machine is scribbled on either way.
+int readSaveFile(const char *appname, const char *filename, unsigned char *machine, int machineSize, unsigned long romCrc){
+    size_t size;
+    unsigned char *image = readSaveImage(appname, filename, "MARIOSAV", &size);
+    if(image == NULL) return 0;
+
+    const char *problem = NULL;
+    unsigned char rom[4];
+
+    if(!readSection(image, size, "ROM ", rom, 4)){
+        problem = "damaged or truncated";
+    }
+    else if(get32LE(rom) != romCrc){
+        problem = "saved with a different rom";
+    }
+    else if(!readSection(image, size, "MACH", machine, machineSize)){
+        problem = "machine state is damaged, truncated or from another version";
+    }
+
+    free(image);
+
+    if(problem){
+        printf("%s: %s, not loaded\n", filename, problem);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+
+/* rom cache
+What's worked out from a rom once and kept in the stash dir, so the next
+run maps it instead of working it out again. A "MARIOROM" file named for
+the xxh64 of the whole .nes file, with sections
+
+  KEY   the rom's xxh64 and ROM_CACHE_VERSION
+  TILE  the CHR ROM a byte per pixel (main.c)
+
+Sections are stored uncompressed and used straight out of the mapping.
+Their crcs aren't checked on the way in, that would take longer than
+working them out again, only the section table and KEY are. A cache
+that doesn't match is written over.
+*/
+#define ROM_CACHE_VERSION 1
+
+void romCacheName(char *buf, size_t n, unsigned long long romHash){
+    snprintf(buf, n, "%016llx.romcache", romHash);
+}
+
+void romCacheKey(unsigned char *key, unsigned long long romHash){
+    put32LE(key, romHash & 0xffffffffUL);
+    put32LE(key + 4, romHash >> 32);
+    put32LE(key + 8, ROM_CACHE_VERSION);
+}
+
+// queue the cache for the rom to be written, tiles is copied
+void writeRomCache(const char *appname, unsigned long long romHash, const unsigned char *tiles, long length){
+    char name[64];
+    unsigned char key[12];
+    romCacheName(name, sizeof name, romHash);
+    romCacheKey(key, romHash);
+
+    struct SaveImage *image = newSaveImage("MARIOROM");
+    addSection(image, "KEY ", 0, key, sizeof key);
+    addSection(image, "TILE", 0, tiles, length);
+    queueSaveImage(image, appname, name);
+}
+
+// map the cache for the rom. Returns its TILE section, which has to be
+// length bytes, or NULL if there's no cache or it doesn't match. When
+// it's found, unmapFile(*image, *size) once done with it.
+const unsigned char * mapRomCache(const char *appname, unsigned long long romHash, long length, const unsigned char **image, size_t *size){
+    char name[64];
+    unsigned char key[12];
+    romCacheName(name, sizeof name, romHash);
+    romCacheKey(key, romHash);
+
+    const unsigned char *file = mapSaveFile(appname, name, size);
+    if(file == NULL) return NULL;
+
+    const unsigned char *found = NULL;
+    const unsigned char *stored;
+    if(checkSaveImage(file, *size, "MARIOROM") == NULL){
+        stored = sectionData(file, *size, "KEY ", sizeof key);
+        if(stored && memcmp(stored, key, sizeof key) == 0) found = sectionData(file, *size, "TILE", length);
+    }
+
+    if(found == NULL){
+        unmapFile(file, *size);
+        return NULL;
+    }
+    *image = file;
+    return found;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 FILE * openSaveFileForWriting(const char * appname, const char * filename){
 
@@ -11,3 +12,54 @@ FILE * openSaveFileForReading(const char * appname, const char * filename){
     return NULL;
 
 }
+
+int saveFileExists(const char * appname, const char * filename){
+
+    return 0;
+
+}
+
+int replaceSaveFile(const char * appname, const char * from, const char * to){
+
+    return 0;
+
+}
+
+const unsigned char * mapSaveFile(const char * appname, const char * filename, size_t * size){
+
+    return NULL;
+
+}
+
+// no mapping here, the file is read into memory instead
+const unsigned char * mapFile(const char * path, size_t * size){
+
+    FILE * file = fopen(path, "rb");
+    if(file == NULL){
+        fprintf(stderr, "can't open %s\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long n = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char * data = n > 0 ? malloc(n) : NULL;
+    if(data == NULL || fread(data, 1, n, file) != (size_t)n){
+        fprintf(stderr, "can't read %s\n", path);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = n;
+    return data;
+
+}
+
+void unmapFile(const unsigned char * data, size_t size){
+
+    free((void *)data);
+
+}